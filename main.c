@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
 // Library include           // What it's used for
 // --------------------------//-------------------
 #include <gtk/gtk.h>         // windowing
@@ -10,23 +10,294 @@
 #include <inttypes.h>        // string to int conversion
 #include <signal.h>          // handling SIGUSR1
 #include <string.h>          // string parsing for --webkit-settings
+#include <unistd.h>          // getpid, sysconf
+#include <math.h>            // floor, ceil
+#include <errno.h>           // errno, for --data-fifo errors
+#include <fcntl.h>           // opening --data-fifo
+#include <sys/stat.h>        // creating --data-fifo
+#include <sys/mman.h>        // --export-frames shared memory
+#include <sys/inotify.h>     // --watch
+#include <stdint.h>          // --export-frames header fields
+#include <gio/gunixsocketaddress.h> // --data-socket
+#include <gio/gunixinputstream.h>   // reading --data-fifo
+#include <glib-unix.h>               // watching the X connection
+#include <gdk/gdkx.h>                // X window IDs
+#include <X11/Xatom.h>               // fullscreen window detection
+#include <X11/extensions/scrnsaver.h> // screensaver state
+#include <X11/extensions/dpms.h>     // monitor power state
+#include <X11/extensions/XInput2.h>  // --input-events
+#include <X11/XKBlib.h>              // key names for --input-events
+#ifdef __SSE2__
+#include <emmintrin.h>               // --clickable-alpha's kernel
+#endif
+
+// How an event combines with an earlier one of the same name (and key) that
+// is still waiting to be delivered to the page.
+enum event_coalescing {
+    // Both are delivered, in order.
+    EVENT_QUEUE,
+    // Only the newer one is delivered.  For things where only the current
+    // state matters.
+    EVENT_LATEST,
+    // They're merged into one, with numeric properties added together.  For
+    // high-rate sources of deltas, like pointer motion.
+    EVENT_ACCUMULATE,
+};
+
+struct pending_event {
+    char *name;
+    // Events only coalesce with ones that have the same key too, so one event
+    // name can carry several independent streams.  May be NULL.
+    char *key;
+    JSCValue *data;
+    // When it was queued, from g_get_monotonic_time.  Coalescing doesn't
+    // change it.
+    gint64 queued_at;
+};
+
+// Events on their way from us to one layer's page.
+//
+// Rather than evaluating a script per event, events are queued here, and
+// delivered as one batch per frame, as the reply to a message the page keeps
+// outstanding for the purpose.  See `emit_event`.
+struct event_queue {
+    GArray *pending; // of struct pending_event
+    // Names of events the page has listeners for.  Nothing else gets queued,
+    // so sources nobody listens to cost next to nothing.
+    GHashTable *subscribed;
+    // The page's outstanding request for events, or NULL if it's busy
+    // handling the previous batch.
+    WebKitScriptMessageReply *reply;
+    // If nonzero, a delivery is waiting for the next frame clock tick (or
+    // idle, if the window isn't mapped).
+    guint tick_id;
+    guint idle_id;
+};
+
+#define N_FRAME_HISTOGRAM_BUCKETS 13
+
+// How smoothly an overlay has been rendering, from its window's frame clock.
+// Times are in microseconds, from g_get_monotonic_time, unless named
+// otherwise.
+struct frame_stats {
+    guint64 frames;
+    guint64 missed_frames;
+    gint64 refresh_interval_us;
+    double paint_total_ms;
+    double paint_max_ms;
+    // Counts per bucket; see `frame_histogram_bounds_ms`.
+    guint64 interval_histogram[N_FRAME_HISTOGRAM_BUCKETS];
+    guint64 paint_histogram[N_FRAME_HISTOGRAM_BUCKETS];
+
+    // When the paint in progress started, or 0 if none is.
+    gint64 paint_start;
+    // The frame clock's time for the last frame that was painted.
+    gint64 last_frame_time;
+};
+
+struct overlay;
+struct frame_export;
+
+// With --clickable-alpha, a layer's record of which of its pixels are
+// clickable.  See `update_alpha_mask`.
+struct alpha_mask {
+    int width, height;
+    // What the web view last rendered.
+    cairo_surface_t *image;
+    // For each row, a GArray of x coordinates: the start and end (exclusive)
+    // of each run of clickable pixels in it.
+    GPtrArray *row_runs;
+    // What's been redrawn since, and so needs rescanning.
+    cairo_region_t *damage;
+    // The clickable pixels, as a region.
+    cairo_region_t *region;
+    // If nonzero, an update is scheduled.
+    guint update_id;
+    gint64 last_update;
+};
+
+// One page, in its own web view.  Every URL given on the command line gets a
+// layer in each overlay window, stacked in the order they were given: the
+// first is at the bottom.
+struct layer {
+    struct overlay *overlay;
+    WebKitWebView *web_view;
+    WebKitWebInspector *inspector;
+
+    // Stored rectangles out of which we can construct the input shape on
+    // demand.  The attached inspector's rectangle is stored separately, so
+    // when user code modifies the other rectangles, the inspector's rectangle
+    // can't be overwritten.
+    cairo_rectangle_int_t attached_inspector_input_rect;
+    GArray *user_defined_input_rects;
+    // The input shape last set on this layer's web view, if there's more than
+    // one layer.  NULL if none has been set yet.
+    cairo_region_t *applied_input_shape;
+
+    // With --shape-to-painted, what the page paints: the rectangles it
+    // declared, if it has, or else what we last detected.
+    bool declares_painted_areas;
+    GArray *painted_rects;
+    cairo_region_t *detected_painted_region;
+
+    struct alpha_mask alpha_mask;
+    // Set while we draw the web view ourselves, to analyse what it renders.
+    bool drawing_for_analysis;
+
+    struct event_queue events;
+    // The frame clock time of the last `frame` event it was sent.
+    gint64 last_frame_event_time;
+
+    // The frame rate limit the page asked for, or -1 if it hasn't.
+    double page_fps_limit;
+
+    // Whether --startup-trace is done with this layer.
+    bool startup_traced;
+
+    // If nonzero, the page is waiting to be reloaded after its web process
+    // went away.
+    guint restart_id;
+    // How long the last such wait was, and when the reload happened, for
+    // backing off if it keeps crashing.
+    guint restart_delay_ms;
+    gint64 last_restart_time;
+
+    gulong inspector_size_allocate_handler_id;
+};
+
+// An overlay window, and the layers inside it.
+//
+// Normally there is exactly one, sized to cover every monitor.  With
+// --per-monitor, there is one per monitor, each sized to exactly that monitor,
+// so we don't pay for backing store and compositor blending of the parts of
+// the bounding box that no monitor actually shows.
+struct overlay {
+    GtkWidget *window;
+    // A GtkOverlay that stacks the layers' web views on top of each other.
+    GtkWidget *stack;
+    // The layers, bottom first.
+    GPtrArray *layers;
+
+    // The monitor this overlay covers, or NULL if it covers all of them.  We
+    // hold a reference, so we can safely compare it against the display's
+    // current monitors after a hot-plug.
+    GdkMonitor *monitor;
+    // Where the window was last put, in desktop coordinates.
+    GdkRectangle geometry;
+
+    // The input shape last actually sent to the X server, so we can skip
+    // sending an identical one.  NULL if none has been sent yet.
+    cairo_region_t *applied_input_shape;
+    // The same, for the bounding shape, with --shape-to-painted.
+    cairo_region_t *applied_bounding_shape;
+    // If nonzero, an input shape update is waiting for the next frame clock
+    // tick.
+    guint input_shape_tick_id;
+    // If nonzero, its pages are getting `frame` events.
+    guint frame_event_tick_id;
+
+    struct frame_stats frame_stats;
+    GdkFrameClock *frame_clock;
+    gulong before_paint_handler_id;
+    gulong after_paint_handler_id;
+
+    gulong composited_changed_handler_id;
+
+    // Why the overlay is hidden ("dpms", "screensaver", or "fullscreen"), or
+    // NULL if it isn't.  See `update_visibility`.
+    const char *hidden_reason;
+
+    // With --export-frames, where its frames go.
+    struct frame_export *frame_export;
+    // With --headless, whether it's drawn anything that hasn't been written
+    // out yet.
+    bool drawn_since_capture;
+};
+
+// A monitor, as pages see it.
+struct monitor_info {
+    char *name;
+    GdkRectangle geometry;
+    // How many device pixels there are to each of its logical ones.
+    int scale;
+    // In Hz, or 0 if unknown.
+    double refresh_rate;
+    // Physical size, in millimetres, or 0 if unknown.
+    int width_mm, height_mm;
+};
+
+// All live overlays.  Global because almost everything touches them.
+GPtrArray *overlays;
+
+// Things every overlay is created from.  Set once in `main`, from argv.
+// The URLs of the layers, bottom first.
+GPtrArray *target_urls;
+char *cache_dir = NULL;
+// A WebKitCacheModel, or -1 for the default.
+int cache_model = -1;
+WebKitSettings *wk_settings;
+WebKitWebContext *wk_context;
+bool per_monitor_windows = FALSE;
+
+// From --startup-trace.  If set, we print to stderr when each phase of
+// startup happens, until the page's first paint.
+bool startup_trace_enabled = FALSE;
+// When `main` started, from g_get_monotonic_time.
+gint64 startup_time;
+
+void startup_trace(const char *format, ...) {
+    if (!startup_trace_enabled) return;
+    va_list args;
+    va_start(args, format);
+    char *phase = g_strdup_vprintf(format, args);
+    va_end(args);
+    fprintf(stderr, "startup: %9.3f ms  %s\n",
+            (g_get_monotonic_time() - startup_time) / 1000.0, phase);
+    g_free(phase);
+}
 
-// Overlay window handle.  Global because almost everything touches it.
-GtkWidget *window;
-WebKitWebInspector *inspector;
+// Prints roughly how long it was from exec to `main`, which is mostly
+// dynamic linking of GTK and WebKit.  The kernel only keeps the process
+// start time in clock ticks, so it's no more precise than that.
+static void startup_trace_exec(void) {
+    char *stat = NULL, *uptime = NULL;
+    if (g_file_get_contents("/proc/self/stat", &stat, NULL, NULL) &&
+            g_file_get_contents("/proc/uptime", &uptime, NULL, NULL)) {
+        // The start time is the 22nd field; the process name in parentheses
+        // may contain spaces, so count from after it.
+        unsigned long long start_ticks;
+        char *rest = strrchr(stat, ')');
+        if (rest && sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u"
+                    " %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                    &start_ticks) == 1) {
+            double seconds_since_boot = g_ascii_strtod(uptime, NULL);
+            double start_seconds =
+                (double)start_ticks / sysconf(_SC_CLK_TCK);
+            fprintf(stderr, "startup: %9.3f ms  exec (approximate)\n",
+                    (start_seconds - seconds_since_boot) * 1000);
+        }
+    }
+    g_free(stat);
+    g_free(uptime);
+}
 
-void show_inspector(bool startAttached) {
+void show_inspector(struct layer *layer, bool startAttached) {
     // For some reason calling this twice makes it start detached, but the
     // inspector doesn't seem to respond in any way to the actual functions
     // that are supposed put it in detached or attached mode.  It is a
     // mysterious creature.
-    webkit_web_inspector_show(inspector);
+    webkit_web_inspector_show(layer->inspector);
     if (!startAttached)
-        webkit_web_inspector_show(inspector);
+        webkit_web_inspector_show(layer->inspector);
 }
 
 void on_signal_sigusr1(int signal_number) {
-    show_inspector(FALSE);
+    // Inspect the first overlay's bottom layer.  With --per-monitor, that's
+    // whichever monitor GDK lists first.
+    if (overlays->len > 0) {
+        struct overlay *overlay = g_ptr_array_index(overlays, 0);
+        show_inspector(g_ptr_array_index(overlay->layers, 0), FALSE);
+    }
 }
 
 static void screen_changed(GtkWidget *widget, GdkScreen *old_screen,
@@ -34,52 +305,642 @@ static void screen_changed(GtkWidget *widget, GdkScreen *old_screen,
 static void composited_changed(GdkScreen *screen, gpointer user_data);
 static void on_close_web_view(WebKitWebView *web_view, gpointer user_data);
 
-static void size_to_screen(GtkWindow *window);
-static int get_monitor_rects(GdkDisplay *display, GdkRectangle **rectangles) {
-    int n = gdk_display_get_n_monitors(display);
-    GdkRectangle *new_rectangles = (GdkRectangle*)malloc(n * sizeof(GdkRectangle));
-    for (int i = 0; i < n; ++i) {
-        GdkMonitor *monitor = gdk_display_get_monitor(display, i);
-        gdk_monitor_get_geometry(monitor, &new_rectangles[i]);
-    }
-    *rectangles = new_rectangles;
-    // Ownership of the malloc'd memory transfers out
-    return n;
+static void size_to_screen(struct overlay *overlay);
+
+//
+// Instrumentation
+//
+
+// USDT probes, so a running hudkit can be traced with perf or bpftrace
+// without rebuilding it.  For example, to see how long each kind of call
+// takes:
+//
+//     bpftrace -e 'usdt:./hudkit:hudkit:latency { @[str(arg0)] = hist(arg1) }'
+//
+// Each costs one no-op instruction when nothing is tracing it.  They need
+// <sys/sdt.h> (from systemtap's sdt development package) to build; without
+// it, they're left out.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HUDKIT_PROBE1(name, a) STAP_PROBE1(hudkit, name, a)
+#define HUDKIT_PROBE2(name, a, b) STAP_PROBE2(hudkit, name, a, b)
+#endif
+#endif
+#ifndef HUDKIT_PROBE1
+#define HUDKIT_PROBE1(name, a) do {} while (0)
+#define HUDKIT_PROBE2(name, a, b) do {} while (0)
+#endif
+
+// Things whose latency we measure.  Names are as they appear in
+// `Hudkit.getStats()`.
+enum latency_stat_id {
+    STAT_GET_MONITOR_LAYOUT,
+    STAT_GET_WINDOW_GEOMETRY,
+    STAT_SET_CLICKABLE_AREAS,
+    STAT_SHOW_INSPECTOR,
+    STAT_SET_FRAME_RATE_LIMIT,
+    STAT_GET_FRAME_STATS,
+    STAT_GET_STATS,
+    STAT_EVENTS,
+    STAT_SUBSCRIBE,
+    STAT_SET_PAINTED_AREAS,
+    STAT_REALIZE_INPUT_SHAPE,
+    STAT_PAINT_ANALYSIS,
+    STAT_ALPHA_MASK,
+    STAT_FRAME_EXPORT,
+    STAT_JS_EVALUATION,
+    // Building and sending one batch of events to a page.
+    STAT_EVENT_DISPATCH,
+    // From an event being queued to its batch being sent.
+    STAT_EVENT_QUEUE_WAIT,
+    N_LATENCY_STATS
+};
+static const char *latency_stat_names[N_LATENCY_STATS] = {
+    [STAT_GET_MONITOR_LAYOUT]   = "getMonitorLayout",
+    [STAT_GET_WINDOW_GEOMETRY]  = "getWindowGeometry",
+    [STAT_SET_CLICKABLE_AREAS]  = "setClickableAreas",
+    [STAT_SHOW_INSPECTOR]       = "showInspector",
+    [STAT_SET_FRAME_RATE_LIMIT] = "setFrameRateLimit",
+    [STAT_GET_FRAME_STATS]      = "getFrameStats",
+    [STAT_GET_STATS]            = "getStats",
+    [STAT_EVENTS]               = "_events",
+    [STAT_SUBSCRIBE]            = "_subscribe",
+    [STAT_SET_PAINTED_AREAS]    = "setPaintedAreas",
+    [STAT_REALIZE_INPUT_SHAPE]  = "realizeInputShape",
+    [STAT_PAINT_ANALYSIS]       = "paintAnalysis",
+    [STAT_ALPHA_MASK]           = "alphaMask",
+    [STAT_FRAME_EXPORT]         = "frameExport",
+    [STAT_JS_EVALUATION]        = "jsEvaluation",
+    [STAT_EVENT_DISPATCH]       = "eventDispatch",
+    [STAT_EVENT_QUEUE_WAIT]     = "eventQueueWait",
+};
+
+// Upper bounds of the latency histogram buckets, in microseconds.  There's
+// one more bucket than bounds, catching everything longer.
+static const double latency_histogram_bounds_us[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000
+};
+#define N_LATENCY_HISTOGRAM_BUCKETS \
+    (G_N_ELEMENTS(latency_histogram_bounds_us) + 1)
+
+struct latency_stat {
+    guint64 count;
+    gint64 total_us;
+    gint64 max_us;
+    guint64 histogram[N_LATENCY_HISTOGRAM_BUCKETS];
+} latency_stats[N_LATENCY_STATS];
+
+// Records that something took from `start` (from g_get_monotonic_time) until
+// now.
+void latency_stat_record(enum latency_stat_id id, gint64 start) {
+    gint64 us = g_get_monotonic_time() - start;
+    struct latency_stat *stat = &latency_stats[id];
+    ++stat->count;
+    stat->total_us += us;
+    if (us > stat->max_us) stat->max_us = us;
+    int i = 0;
+    while (i < N_LATENCY_HISTOGRAM_BUCKETS - 1
+            && us > latency_histogram_bounds_us[i]) ++i;
+    ++stat->histogram[i];
+    HUDKIT_PROBE2(latency, latency_stat_names[id], us);
 }
 
-// Stored rectangles out of which we can construct the window's input shape on
-// demand.  The attached inspector's rectangle is stored separately, so when
-// user code modifies the other rectangles, the inspector's rectangle can't be
-// overwritten.
-cairo_rectangle_int_t attached_inspector_input_rect = { 0, 0, 0, 0 };
-GArray *user_defined_input_rects;
-
-void realize_input_shape() {
-    // Our input shape for the overall window should be the rectangles set by
-    // the user, and the rectangle of the attached web inspector (if
-    // applicable), all merged together into one shape.
-
+// How input shape updates have been handled, across all overlays.  Every
+// call to `queue_input_shape` is either coalesced into an update that's
+// already waiting for the next frame, or causes one; every update is either
+// skipped because the shape didn't change, or applied (which costs an X
+// server round trip).
+struct {
+    guint64 requested;
+    guint64 coalesced;
+    guint64 skipped;
+    guint64 applied;
+} input_shape_stats;
+
+// The input shape of one layer: the rectangles set by its page, and the
+// rectangle of its attached web inspector (if applicable), all merged
+// together into one shape.
+//
+// Cairo regions are kept as a minimal list of non-overlapping bands, so
+// overlapping and duplicate rectangles get merged here as they're added.
+static cairo_region_t *layer_input_shape(struct layer *layer) {
     cairo_region_t *shape = cairo_region_create_rectangle(
-            &attached_inspector_input_rect);
-    for (int i = 0; i < user_defined_input_rects->len; ++i) {
+            &layer->attached_inspector_input_rect);
+    for (int i = 0; i < layer->user_defined_input_rects->len; ++i) {
         cairo_rectangle_int_t rect = g_array_index(
-                    user_defined_input_rects,
+                    layer->user_defined_input_rects,
                     cairo_rectangle_int_t,
                     i);
         cairo_region_union_rectangle(shape, &rect);
     }
+    if (layer->alpha_mask.region)
+        cairo_region_union(shape, layer->alpha_mask.region);
+    return shape;
+}
 
-    GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(window));
-    if (gdk_window) // This might be NULL if this gets called during initialisation
-        gdk_window_input_shape_combine_region(gdk_window, shape, 0,0);
-    cairo_region_destroy(shape);
+// With more than one layer, each layer's web view gets its own input shape
+// too.  The upper layers cover the whole window, so without this they'd eat
+// the clicks meant for the clickable areas of the layers below them.  Their
+// GtkOverlay child windows are pass-through, so clicks outside a web view's
+// input shape go on to whatever's below it.
+//
+// These are GDK's own child windows, so this doesn't involve the X server.
+static void apply_layer_input_shape(struct layer *layer,
+        cairo_region_t *shape) {
+    GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(layer->web_view));
+    if (!gdk_window) return;
+    if (layer->applied_input_shape &&
+            cairo_region_equal(shape, layer->applied_input_shape))
+        return;
+    gdk_window_input_shape_combine_region(gdk_window, shape, 0,0);
+    if (layer->applied_input_shape)
+        cairo_region_destroy(layer->applied_input_shape);
+    layer->applied_input_shape = cairo_region_copy(shape);
+}
+
+static void apply_bounding_shape(struct overlay *overlay,
+        const cairo_region_t *input_shape);
+
+static void apply_input_shape(struct overlay *overlay) {
+    // Our input shape for the overall window is every layer's shape merged
+    // together.
+    cairo_region_t *shape = cairo_region_create();
+    for (int i = 0; i < overlay->layers->len; ++i) {
+        struct layer *layer = g_ptr_array_index(overlay->layers, i);
+        cairo_region_t *layer_shape = layer_input_shape(layer);
+        if (overlay->layers->len > 1)
+            apply_layer_input_shape(layer, layer_shape);
+        cairo_region_union(shape, layer_shape);
+        cairo_region_destroy(layer_shape);
+    }
+
+    GdkWindow *gdk_window = gtk_widget_get_window(overlay->window);
+    if (!gdk_window) {
+        // This might be NULL if this gets called during initialisation
+        cairo_region_destroy(shape);
+        return;
+    }
+
+    apply_bounding_shape(overlay, shape);
+
+    if (overlay->applied_input_shape &&
+            cairo_region_equal(shape, overlay->applied_input_shape)) {
+        // Nothing would change, so don't bother the X server.
+        ++input_shape_stats.skipped;
+        cairo_region_destroy(shape);
+        return;
+    }
+
+    gdk_window_input_shape_combine_region(gdk_window, shape, 0,0);
+    ++input_shape_stats.applied;
+    HUDKIT_PROBE1(input_shape_applied, cairo_region_num_rectangles(shape));
+    if (overlay->applied_input_shape)
+        cairo_region_destroy(overlay->applied_input_shape);
+    overlay->applied_input_shape = shape;
+}
+
+// Applies the overlay's input shape right now.
+void realize_input_shape(struct overlay *overlay) {
+    gint64 start = g_get_monotonic_time();
+    apply_input_shape(overlay);
+    latency_stat_record(STAT_REALIZE_INPUT_SHAPE, start);
+}
+
+static gboolean on_input_shape_tick(GtkWidget *widget,
+        GdkFrameClock *frame_clock, gpointer user_data) {
+    struct overlay *overlay = user_data;
+    overlay->input_shape_tick_id = 0;
+    realize_input_shape(overlay);
+    return G_SOURCE_REMOVE;
+}
+
+// Schedules the overlay's input shape (and with --shape-to-painted, its
+// bounding shape) to be updated on the next frame clock tick.  Pages that
+// drag things around can change their clickable areas many times per frame,
+// and only the last of those matters, so there's no point sending all of
+// them to the X server.
+void queue_input_shape(struct overlay *overlay) {
+    ++input_shape_stats.requested;
+
+    if (overlay->input_shape_tick_id) {
+        ++input_shape_stats.coalesced;
+        return;
+    }
+
+    // The frame clock doesn't tick for windows that aren't on screen, so if
+    // ours isn't, just do it now.
+    if (!gtk_widget_get_mapped(overlay->window)) {
+        realize_input_shape(overlay);
+        return;
+    }
+
+    overlay->input_shape_tick_id = gtk_widget_add_tick_callback(
+            overlay->window, on_input_shape_tick, overlay, NULL);
+}
+
+//
+// Painted-bounds window shape
+//
+
+// From --shape-to-painted.  If set, each overlay window's bounding shape is
+// kept to the parts its pages actually paint (plus anything clickable), so
+// the compositor only has to blend those, rather than the whole desktop.
+//
+// Each layer's painted areas come from `Hudkit.setPaintedAreas`, if its page
+// has called it.  Otherwise, every PAINT_ANALYSIS_INTERVAL_MS we draw the
+// layer's web view into a small image and look for tiles with anything that
+// isn't fully transparent in them.  Something newly painted in a tile that
+// wasn't before stays invisible until the next analysis notices it, so pages
+// whose content jumps around should rather declare their areas.
+bool shape_to_painted = FALSE;
+
+#define PAINT_ANALYSIS_INTERVAL_MS 500
+// How much smaller than the window the image we analyse is.  Downscaling
+// averages pixels together, so anything visible still leaves some alpha.
+#define PAINT_ANALYSIS_SCALE 4
+// The size of the tiles the shape is made of, in window pixels.  A multiple
+// of PAINT_ANALYSIS_SCALE.
+#define PAINT_TILE_SIZE 64
+
+// Returns the tiles of the layer's web view with anything painted in them.
+static cairo_region_t *detect_painted_region(struct layer *layer) {
+    GtkWidget *widget = GTK_WIDGET(layer->web_view);
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    int image_width = (width + PAINT_ANALYSIS_SCALE - 1) / PAINT_ANALYSIS_SCALE;
+    int image_height =
+        (height + PAINT_ANALYSIS_SCALE - 1) / PAINT_ANALYSIS_SCALE;
+
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            image_width, image_height);
+    cairo_t *cr = cairo_create(image);
+    cairo_scale(cr, 1.0 / PAINT_ANALYSIS_SCALE, 1.0 / PAINT_ANALYSIS_SCALE);
+    layer->drawing_for_analysis = TRUE;
+    gtk_widget_draw(widget, cr);
+    layer->drawing_for_analysis = FALSE;
+    cairo_destroy(cr);
+    cairo_surface_flush(image);
+
+    // Pixels are native-endian 32-bit ARGB, so alpha is the top byte.
+    const unsigned char *data = cairo_image_surface_get_data(image);
+    int stride = cairo_image_surface_get_stride(image);
+    int tile = PAINT_TILE_SIZE / PAINT_ANALYSIS_SCALE;
+    int n_columns = (image_width + tile - 1) / tile;
+    cairo_region_t *region = cairo_region_create();
+    for (int tile_y = 0; tile_y * tile < image_height; ++tile_y) {
+        for (int tile_x = 0; tile_x < n_columns; ++tile_x) {
+            int x_end = MIN((tile_x + 1) * tile, image_width);
+            int y_end = MIN((tile_y + 1) * tile, image_height);
+            bool painted = FALSE;
+            for (int y = tile_y * tile; y < y_end && !painted; ++y) {
+                const guint32 *row = (const guint32 *)(data + y * stride);
+                for (int x = tile_x * tile; x < x_end; ++x) {
+                    if (row[x] >> 24) {
+                        painted = TRUE;
+                        break;
+                    }
+                }
+            }
+            if (painted) {
+                cairo_rectangle_int_t rect = {
+                    tile_x * PAINT_TILE_SIZE, tile_y * PAINT_TILE_SIZE,
+                    PAINT_TILE_SIZE, PAINT_TILE_SIZE
+                };
+                cairo_region_union_rectangle(region, &rect);
+            }
+        }
+    }
+    cairo_surface_destroy(image);
+    return region;
+}
+
+static gboolean on_paint_analysis(gpointer user_data) {
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        // Nobody sees a hidden overlay, so what it paints doesn't matter.
+        if (overlay->hidden_reason) continue;
+        bool changed = FALSE;
+        for (int j = 0; j < overlay->layers->len; ++j) {
+            struct layer *layer = g_ptr_array_index(overlay->layers, j);
+            if (layer->declares_painted_areas) continue;
+            gint64 start = g_get_monotonic_time();
+            cairo_region_t *region = detect_painted_region(layer);
+            latency_stat_record(STAT_PAINT_ANALYSIS, start);
+            if (layer->detected_painted_region &&
+                    cairo_region_equal(region,
+                        layer->detected_painted_region)) {
+                cairo_region_destroy(region);
+                continue;
+            }
+            if (layer->detected_painted_region)
+                cairo_region_destroy(layer->detected_painted_region);
+            layer->detected_painted_region = region;
+            changed = TRUE;
+        }
+        if (changed) queue_input_shape(overlay);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Sets the window's bounding shape to everything its layers paint, and
+// everything clickable, since X clips the input shape to the bounding shape.
+static void apply_bounding_shape(struct overlay *overlay,
+        const cairo_region_t *input_shape) {
+    if (!shape_to_painted) return;
+    GdkWindow *gdk_window = gtk_widget_get_window(overlay->window);
+
+    cairo_region_t *shape = cairo_region_copy(input_shape);
+    for (int i = 0; i < overlay->layers->len; ++i) {
+        struct layer *layer = g_ptr_array_index(overlay->layers, i);
+        if (layer->declares_painted_areas) {
+            for (int j = 0; j < layer->painted_rects->len; ++j) {
+                cairo_rectangle_int_t rect = g_array_index(
+                        layer->painted_rects, cairo_rectangle_int_t, j);
+                cairo_region_union_rectangle(shape, &rect);
+            }
+        } else if (layer->detected_painted_region) {
+            cairo_region_union(shape, layer->detected_painted_region);
+        }
+    }
+
+    if (overlay->applied_bounding_shape &&
+            cairo_region_equal(shape, overlay->applied_bounding_shape)) {
+        cairo_region_destroy(shape);
+        return;
+    }
+    gdk_window_shape_combine_region(gdk_window, shape, 0,0);
+    HUDKIT_PROBE1(bounding_shape_applied, cairo_region_num_rectangles(shape));
+    if (overlay->applied_bounding_shape)
+        cairo_region_destroy(overlay->applied_bounding_shape);
+    overlay->applied_bounding_shape = shape;
+}
+
+//
+// Clickable areas from alpha
+//
+
+// From --clickable-alpha.  If nonzero, every pixel a page renders with at
+// least this alpha is clickable, on top of the areas it sets itself.
+//
+// Each layer keeps a full-size copy of what its web view last rendered, and
+// for each row, the runs of pixels in it that are clickable.  Whenever the
+// web view draws, the area GTK had it redraw is noted as damaged; at most
+// every ALPHA_MASK_INTERVAL_MS, just that area is rendered into the copy,
+// the rows it touches are rescanned, and the runs of all rows are merged
+// into rectangles for the input shape.
+int clickable_alpha = 0;
+
+#define ALPHA_MASK_INTERVAL_MS 50
+
+// Appends the runs of pixels in `row` whose alpha is at least `threshold` to
+// `runs`, as pairs of start and end (exclusive) x coordinates.
+static void find_alpha_runs(const guint32 *row, int width, guint8 threshold,
+        GArray *runs) {
+    int x = 0;
+    int run_start = -1;
+#ifdef __SSE2__
+    // 16 pixels at a time: pick out their alpha bytes, compare them all to
+    // the threshold, and only look at individual pixels if they aren't all
+    // the same as the run we're in (or not in).  Most of a HUD is long
+    // stretches of nothing, so mostly we don't.
+    const __m128i min_alpha = _mm_set1_epi8((char)threshold);
+    for (; x + 16 <= width; x += 16) {
+        const __m128i *pixels = (const __m128i *)(row + x);
+        __m128i a0 = _mm_srli_epi32(_mm_loadu_si128(pixels), 24);
+        __m128i a1 = _mm_srli_epi32(_mm_loadu_si128(pixels + 1), 24);
+        __m128i a2 = _mm_srli_epi32(_mm_loadu_si128(pixels + 2), 24);
+        __m128i a3 = _mm_srli_epi32(_mm_loadu_si128(pixels + 3), 24);
+        __m128i alpha = _mm_packus_epi16(_mm_packs_epi32(a0, a1),
+                _mm_packs_epi32(a2, a3));
+        // Unsigned a >= b is max(a, b) == a.
+        __m128i clickable = _mm_cmpeq_epi8(_mm_max_epu8(alpha, min_alpha),
+                alpha);
+        unsigned int mask = _mm_movemask_epi8(clickable);
+        if (mask == (run_start >= 0 ? 0xFFFF : 0)) continue;
+        for (int i = 0; i < 16; ++i) {
+            bool is_clickable = mask >> i & 1;
+            if (is_clickable && run_start < 0) {
+                run_start = x + i;
+            } else if (!is_clickable && run_start >= 0) {
+                gint32 run[2] = { run_start, x + i };
+                g_array_append_vals(runs, run, 2);
+                run_start = -1;
+            }
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        bool is_clickable = row[x] >> 24 >= threshold;
+        if (is_clickable && run_start < 0) {
+            run_start = x;
+        } else if (!is_clickable && run_start >= 0) {
+            gint32 run[2] = { run_start, x };
+            g_array_append_vals(runs, run, 2);
+            run_start = -1;
+        }
+    }
+    if (run_start >= 0) {
+        gint32 run[2] = { run_start, width };
+        g_array_append_vals(runs, run, 2);
+    }
+}
+
+// A run that's continued unchanged down from row `y`, so far.
+struct open_run {
+    gint32 x0, x1, y;
+};
+
+// Merges runs that continue unchanged from one row to the next into
+// rectangles, and returns the region they make up.
+static cairo_region_t *alpha_mask_region(struct alpha_mask *mask) {
+    GArray *rects = g_array_new(FALSE, FALSE, sizeof(cairo_rectangle_int_t));
+    GArray *open = g_array_new(FALSE, FALSE, sizeof(struct open_run));
+    GArray *next_open = g_array_new(FALSE, FALSE, sizeof(struct open_run));
+
+    // One more row than there is, with no runs, to close everything.
+    for (int y = 0; y <= mask->height; ++y) {
+        GArray *runs = y < mask->height
+            ? g_ptr_array_index(mask->row_runs, y) : NULL;
+        int n_runs = runs ? runs->len / 2 : 0;
+        g_array_set_size(next_open, 0);
+
+        // Both are ordered by x, and don't overlap, so walk them together.
+        int i = 0, j = 0;
+        while (i < open->len || j < n_runs) {
+            struct open_run *o = i < open->len
+                ? &g_array_index(open, struct open_run, i) : NULL;
+            gint32 *run = j < n_runs ? &g_array_index(runs, gint32, j * 2)
+                : NULL;
+            if (o && run && o->x0 == run[0] && o->x1 == run[1]) {
+                g_array_append_val(next_open, *o);
+                ++i;
+                ++j;
+            } else if (o && (!run || o->x0 <= run[0])) {
+                cairo_rectangle_int_t rect = {
+                    o->x0, o->y, o->x1 - o->x0, y - o->y
+                };
+                g_array_append_val(rects, rect);
+                ++i;
+            } else {
+                struct open_run started = { run[0], run[1], y };
+                g_array_append_val(next_open, started);
+                ++j;
+            }
+        }
+        GArray *swap = open;
+        open = next_open;
+        next_open = swap;
+    }
+
+    cairo_region_t *region = cairo_region_create_rectangles(
+            (cairo_rectangle_int_t *)rects->data, rects->len);
+    g_array_free(rects, TRUE);
+    g_array_free(open, TRUE);
+    g_array_free(next_open, TRUE);
+    return region;
+}
+
+static void alpha_mask_clear(struct alpha_mask *mask) {
+    if (mask->image) cairo_surface_destroy(mask->image);
+    if (mask->row_runs) g_ptr_array_unref(mask->row_runs);
+    if (mask->damage) cairo_region_destroy(mask->damage);
+    if (mask->region) cairo_region_destroy(mask->region);
+    if (mask->update_id) g_source_remove(mask->update_id);
+    memset(mask, 0, sizeof *mask);
+}
+
+static void update_alpha_mask(struct layer *layer) {
+    struct alpha_mask *mask = &layer->alpha_mask;
+    GtkWidget *widget = GTK_WIDGET(layer->web_view);
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    if (width <= 0 || height <= 0) return;
+
+    if (!mask->image || width != mask->width || height != mask->height) {
+        // Resized, so start over.
+        cairo_region_t *region = mask->region;
+        mask->region = NULL;
+        alpha_mask_clear(mask);
+        mask->region = region;
+        mask->width = width;
+        mask->height = height;
+        mask->image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                width, height);
+        mask->row_runs = g_ptr_array_new_with_free_func(
+                (GDestroyNotify)g_array_unref);
+        for (int y = 0; y < height; ++y)
+            g_ptr_array_add(mask->row_runs,
+                    g_array_new(FALSE, FALSE, sizeof(gint32)));
+        cairo_rectangle_int_t all = { 0, 0, width, height };
+        mask->damage = cairo_region_create_rectangle(&all);
+    }
+
+    cairo_rectangle_int_t bounds = { 0, 0, width, height };
+    cairo_region_intersect_rectangle(mask->damage, &bounds);
+    if (cairo_region_is_empty(mask->damage)) return;
+    gint64 start = g_get_monotonic_time();
+
+    // Render just the damaged area, over nothing.
+    cairo_t *cr = cairo_create(mask->image);
+    gdk_cairo_region(cr, mask->damage);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    layer->drawing_for_analysis = TRUE;
+    gtk_widget_draw(widget, cr);
+    layer->drawing_for_analysis = FALSE;
+    cairo_destroy(cr);
+    cairo_surface_flush(mask->image);
+
+    // Whole rows are rescanned.  The kernel is fast enough that it isn't
+    // worth keeping track of which part of a row's runs changed.
+    cairo_rectangle_int_t damaged;
+    cairo_region_get_extents(mask->damage, &damaged);
+    const unsigned char *data = cairo_image_surface_get_data(mask->image);
+    int stride = cairo_image_surface_get_stride(mask->image);
+    for (int y = damaged.y; y < damaged.y + damaged.height; ++y) {
+        GArray *runs = g_ptr_array_index(mask->row_runs, y);
+        g_array_set_size(runs, 0);
+        find_alpha_runs((const guint32 *)(data + y * stride), width,
+                clickable_alpha, runs);
+    }
+    cairo_region_destroy(mask->damage);
+    mask->damage = cairo_region_create();
+
+    cairo_region_t *region = alpha_mask_region(mask);
+    latency_stat_record(STAT_ALPHA_MASK, start);
+    HUDKIT_PROBE2(alpha_mask_updated, damaged.height,
+            cairo_region_num_rectangles(region));
+    if (mask->region && cairo_region_equal(region, mask->region)) {
+        cairo_region_destroy(region);
+        return;
+    }
+    if (mask->region) cairo_region_destroy(mask->region);
+    mask->region = region;
+    queue_input_shape(layer->overlay);
+}
+
+static gboolean on_alpha_mask_update(gpointer user_data) {
+    struct layer *layer = user_data;
+    layer->alpha_mask.update_id = 0;
+    layer->alpha_mask.last_update = g_get_monotonic_time();
+    update_alpha_mask(layer);
+    return G_SOURCE_REMOVE;
+}
+
+// Notes what the web view redraws as damaged, and schedules an update.
+static gboolean on_web_view_draw(GtkWidget *widget, cairo_t *cr,
+        gpointer user_data) {
+    struct layer *layer = user_data;
+    struct alpha_mask *mask = &layer->alpha_mask;
+    // Our own drawing for the mask doesn't change anything.
+    if (layer->drawing_for_analysis) return FALSE;
+
+    if (!mask->damage) mask->damage = cairo_region_create();
+    cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list(cr);
+    if (clip->status == CAIRO_STATUS_SUCCESS) {
+        for (int i = 0; i < clip->num_rectangles; ++i) {
+            cairo_rectangle_t *r = &clip->rectangles[i];
+            cairo_rectangle_int_t rect = {
+                floor(r->x), floor(r->y),
+                ceil(r->x + r->width) - floor(r->x),
+                ceil(r->y + r->height) - floor(r->y)
+            };
+            cairo_region_union_rectangle(mask->damage, &rect);
+        }
+    } else {
+        // The clip isn't made of rectangles, so assume everything.
+        cairo_rectangle_int_t all = {
+            0, 0,
+            gtk_widget_get_allocated_width(widget),
+            gtk_widget_get_allocated_height(widget)
+        };
+        cairo_region_union_rectangle(mask->damage, &all);
+    }
+    cairo_rectangle_list_destroy(clip);
+
+    if (!mask->update_id) {
+        gint64 wait_ms = ALPHA_MASK_INTERVAL_MS -
+            (g_get_monotonic_time() - mask->last_update) / 1000;
+        mask->update_id = g_timeout_add(MAX(0, wait_ms),
+                on_alpha_mask_update, layer);
+    }
+    return FALSE;
 }
 
+// Pass this a g_new'd gint64 of when the evaluation was started, as
+// `user_data`, so it can be timed.
 static void on_js_call_finished(GObject *object, GAsyncResult *result,
         gpointer user_data) {
     JSCValue *value;
     GError *error = NULL;
 
+    gint64 *start = user_data;
+    latency_stat_record(STAT_JS_EVALUATION, *start);
+    g_free(start);
+
     value = webkit_web_view_evaluate_javascript_finish(WEBKIT_WEB_VIEW(object), result, &error);
     if (!value) {
         g_warning("Error running JavaScript: %s", error->message);
@@ -89,347 +950,4439 @@ static void on_js_call_finished(GObject *object, GAsyncResult *result,
     g_object_unref(value);
 }
 
-void call_js_callback(WebKitWebView *web_view, int callbackId, char *stringifiedData) {
-    // Calls the user JS callback with the given ID, simply up string-placing
-    // the stringified data between its call parentheses.
-    //
-    // Ensure `stringifiedData` is sanitised!  It will basically be `eval`ed in
-    // the web page's context.
+// JavaScript context that we build the values we send to pages in.  Values
+// are serialised when sent, so they can be built in any context, and this
+// one lives as long as we do, so values in it can be cached.
+JSCContext *native_js_context;
 
-    GString *response_buffer = g_string_new(NULL);
-    g_string_append_printf(response_buffer,
-            "window.Hudkit._pendingCallbacks[%i].resolve(%s)"
-            "\ndelete window.Hudkit._pendingCallbacks[%i]",
-            callbackId, stringifiedData, callbackId);
+static void js_set_number(JSCValue *object, const char *name, double number) {
+    JSCValue *value = jsc_value_new_number(native_js_context, number);
+    jsc_value_object_set_property(object, name, value);
+    g_object_unref(value);
+}
 
-    char *finished_buffer = g_string_free(response_buffer, FALSE);
-    webkit_web_view_evaluate_javascript(
-        web_view,
-        finished_buffer,
-        -1, // `length` (-1 indicates a NULL-terminated string)
-        NULL, // `world_name` (NULL indicates default)
-        NULL, // `source_uri` (NULL indicates there's no associated file)
-        NULL, // `cancellable` (NULL indicates we don't care)
-        on_js_call_finished, // callback
-        NULL // `user_data`
-    );
-    g_free(finished_buffer);
+static void js_set_string(JSCValue *object, const char *name,
+        const char *string) {
+    JSCValue *value = jsc_value_new_string(native_js_context, string);
+    jsc_value_object_set_property(object, name, value);
+    g_object_unref(value);
 }
 
-void on_js_call_get_monitor_layout(WebKitUserContentManager *manager,
-        WebKitJavascriptResult *sentData,
-        gpointer arg) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(arg);
-    JSCValue *jsValue = webkit_javascript_result_get_js_value(sentData);
-    int callbackId = jsc_value_to_int32(jsValue);
+static void js_set_boolean(JSCValue *object, const char *name, bool boolean) {
+    JSCValue *value = jsc_value_new_boolean(native_js_context, boolean);
+    jsc_value_object_set_property(object, name, value);
+    g_object_unref(value);
+}
+
+static JSCValue *js_rectangle_new(GdkRectangle *rect) {
+    JSCValue *object = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_number(object, "x", rect->x);
+    js_set_number(object, "y", rect->y);
+    js_set_number(object, "width", rect->width);
+    js_set_number(object, "height", rect->height);
+    return object;
+}
 
-    // TODO get display from web_view?  Just in case it has somehow changed
-    // between then and now.
-    GdkDisplay *display = gdk_display_get_default();
-    GdkRectangle *rectangles = NULL;
-    int nRectangles = get_monitor_rects(display, &rectangles);
+//
+// Events from us to pages
+//
+
+// Most events a page can have queued before we start dropping new ones.  Only
+// matters if the page stops taking them, such as while it's stuck in a long
+// loop, since otherwise the queue empties every frame.
+#define MAX_PENDING_EVENTS 4096
+
+// What's happened to events, across all layers.  Every emitted event that
+// has a listener is either coalesced into one that's already queued, dropped
+// because the queue is full, or queued, and queued ones are delivered in
+// batches.
+struct {
+    guint64 emitted;
+    guint64 coalesced;
+    guint64 dropped;
+    guint64 delivered;
+    guint64 batches;
+} event_stats;
+
+static void pending_event_clear(gpointer data) {
+    struct pending_event *event = data;
+    g_free(event->name);
+    g_free(event->key);
+    g_object_unref(event->data);
+}
+
+void event_queue_init(struct event_queue *events) {
+    events->pending = g_array_new(FALSE, TRUE, sizeof(struct pending_event));
+    g_array_set_clear_func(events->pending, pending_event_clear);
+    events->subscribed = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+}
 
-    GdkMonitor *monitors[nRectangles];
-    for (int i = 0; i < nRectangles; ++i) {
-        monitors[i] = gdk_display_get_monitor(display, i);
+// Forgets everything about the page, such as when it's navigated away from.
+// The next page subscribes to whatever it wants itself.
+void event_queue_reset(struct event_queue *events) {
+    g_array_set_size(events->pending, 0);
+    g_hash_table_remove_all(events->subscribed);
+    if (events->reply) {
+        webkit_script_message_reply_unref(events->reply);
+        events->reply = NULL;
     }
+}
 
-    GString *response_buffer = g_string_new("[");
-    for (int i = 0; i < nRectangles; ++i) {
+void event_queue_clear(struct layer *layer) {
+    struct event_queue *events = &layer->events;
+    event_queue_reset(events);
+    if (events->tick_id)
+        gtk_widget_remove_tick_callback(layer->overlay->window,
+                events->tick_id);
+    if (events->idle_id) g_source_remove(events->idle_id);
+    g_array_free(events->pending, TRUE);
+    g_hash_table_destroy(events->subscribed);
+}
 
-        g_string_append(response_buffer, "{name:'");
+bool layer_is_subscribed(struct layer *layer, const char *name) {
+    return g_hash_table_contains(layer->events.subscribed, name);
+}
 
-        // Escape the JS string contents escape, to prevent XSS via monitor
-        // model string.  Yes, seriously.
-        //
-        // The unlikely attack (or more likely, an unlucky coincidence) that is
-        // that a monitor model string could contain a character that
-        // JavaScript string literals treat specially, such as a newline or
-        // closing quote, which would cause a parse error, or in the worst case
-        // execute the rest of the input as JS in the page context.
-        const char *monitor_model_string = gdk_monitor_get_model(monitors[i]);
-        // Uncomment to test sample XSS attack:
-        //monitor_model_string = "evil\', attack: alert('xss'), _:\'";
-
-        int monitor_model_string_length = strlen(monitor_model_string);
-
-        // Worst-case the escaped output twice as long: if we need to escape
-        // every character.  Plus 1 for the terminating \0.
-        for (int index = 0; index < monitor_model_string_length; ++index) {
-            char charHere = monitor_model_string[index];
-            // Spec for JS string literals' parsing grammar:
-            // http://www.ecma-international.org/ecma-262/5.1/#sec-7.8.4
-            //
-            // We have to backslash-escape every character excluded from either
-            // the DoubleStringCharacter or SingleStringCharacter productions.
-            switch (charHere) {
-
-                // Directly named excluded characters:
-                // \ (backslash)
-                case '\\':
-                // ' (single quote)
-                case '\'':
-                // " (double quote)
-                case '"':
-                    // Just put a backslash in front of it
-                    g_string_append_c(response_buffer, '\\');
-                    g_string_append_c(response_buffer, charHere);
-                    break;
+// Whether any layer's page is listening for the named event.  Sources that
+// cost something to run can use this to only run while someone cares.
+bool anyone_is_subscribed(const char *name) {
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        for (int j = 0; j < overlay->layers->len; ++j)
+            if (layer_is_subscribed(g_ptr_array_index(overlay->layers, j),
+                        name))
+                return TRUE;
+    }
+    return FALSE;
+}
 
-                // Characters excluded because they're part of LineTerminator:
-                // <LF> (line feed)
-                case '\n':
-                    g_string_append(response_buffer, "\\n");
-                    break;
-                // <CR> (carriage return)
-                case '\r':
-                    g_string_append(response_buffer, "\\r");
-                    break;
-                // <LS> (line separator)
-                // <PS> (paragraph separator)
-                //
-                // Those last 2 are Unicode, and not representable in ASCII,
-                // which we're working in, so we don't have to deal with them.
-                //
-                // Just in case, I checked that WebKit really does treat the
-                // script as ASCII, discarding out-of range bit patterns that
-                // would form valid Unicode.  It does this even if the target
-                // document is declared with <meta charset="utf-8">.
-
-                // Anything  else is fine in a JavaScript string literal.  Yes,
-                // this even includes other control characters.
-                default:
-                    g_string_append_c(response_buffer, charHere);
-                    break;
+// Returns a new value with the numeric properties of both added together.
+// Anything else is taken from `newer`.
+static JSCValue *accumulate_event_data(JSCValue *older, JSCValue *newer) {
+    if (jsc_value_is_number(older) && jsc_value_is_number(newer))
+        return jsc_value_new_number(native_js_context,
+                jsc_value_to_double(older) + jsc_value_to_double(newer));
+    if (!jsc_value_is_object(older) || !jsc_value_is_object(newer))
+        return g_object_ref(newer);
+
+    // The older value may be shared with other layers' queues, so it's
+    // copied rather than changed.
+    JSCValue *sum = jsc_value_new_object(native_js_context, NULL, NULL);
+    char **older_names = jsc_value_object_enumerate_properties(older);
+    for (char **name = older_names; name && *name; ++name) {
+        JSCValue *value = jsc_value_object_get_property(older, *name);
+        jsc_value_object_set_property(sum, *name, value);
+        g_object_unref(value);
+    }
+    g_strfreev(older_names);
+
+    char **newer_names = jsc_value_object_enumerate_properties(newer);
+    for (char **name = newer_names; name && *name; ++name) {
+        JSCValue *a = jsc_value_object_get_property(sum, *name);
+        JSCValue *b = jsc_value_object_get_property(newer, *name);
+        if (jsc_value_is_number(a) && jsc_value_is_number(b))
+            js_set_number(sum, *name,
+                    jsc_value_to_double(a) + jsc_value_to_double(b));
+        else
+            jsc_value_object_set_property(sum, *name, b);
+        g_object_unref(a);
+        g_object_unref(b);
+    }
+    g_strfreev(newer_names);
+    return sum;
+}
+
+// Replies to the page's outstanding request for events with everything
+// that's queued, as one flat Array of alternating names and data.
+static void deliver_events(struct layer *layer) {
+    struct event_queue *events = &layer->events;
+    if (!events->reply || events->pending->len == 0) return;
+    gint64 start = g_get_monotonic_time();
+
+    GPtrArray *batch = g_ptr_array_new_full(events->pending->len * 2,
+            g_object_unref);
+    for (int i = 0; i < events->pending->len; ++i) {
+        struct pending_event *event =
+            &g_array_index(events->pending, struct pending_event, i);
+        g_ptr_array_add(batch,
+                jsc_value_new_string(native_js_context, event->name));
+        g_ptr_array_add(batch, g_object_ref(event->data));
+        latency_stat_record(STAT_EVENT_QUEUE_WAIT, event->queued_at);
+    }
+    JSCValue *value = jsc_value_new_array_from_garray(native_js_context, batch);
+    g_ptr_array_unref(batch);
+
+    webkit_script_message_reply_return_value(events->reply, value);
+    g_object_unref(value);
+    webkit_script_message_reply_unref(events->reply);
+    events->reply = NULL;
+
+    event_stats.delivered += events->pending->len;
+    ++event_stats.batches;
+    HUDKIT_PROBE1(events_delivered, events->pending->len);
+    g_array_set_size(events->pending, 0);
+    latency_stat_record(STAT_EVENT_DISPATCH, start);
+}
+
+static gboolean on_events_tick(GtkWidget *widget, GdkFrameClock *frame_clock,
+        gpointer user_data) {
+    struct layer *layer = user_data;
+    layer->events.tick_id = 0;
+    deliver_events(layer);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_events_idle(gpointer user_data) {
+    struct layer *layer = user_data;
+    layer->events.idle_id = 0;
+    deliver_events(layer);
+    return G_SOURCE_REMOVE;
+}
+
+// Arranges for queued events to be delivered with the next frame, so however
+// many are emitted in between, the page only wakes up once per frame.
+static void schedule_event_delivery(struct layer *layer) {
+    struct event_queue *events = &layer->events;
+    GtkWidget *window = layer->overlay->window;
+    if (events->tick_id || events->idle_id) return;
+    if (!events->reply || events->pending->len == 0) return;
+
+    // The frame clock doesn't tick for windows that aren't on screen, so
+    // those get theirs whenever we're next idle instead.
+    if (gtk_widget_get_mapped(window))
+        events->tick_id = gtk_widget_add_tick_callback(window,
+                on_events_tick, layer, NULL);
+    else
+        events->idle_id = g_idle_add(on_events_idle, layer);
+}
+
+// Queues an event for the layer's page, whose listeners for `name` get
+// called with `data` as the argument.  Takes ownership of `data`.  Does
+// nothing if the page has no listeners for it.
+//
+// `key` and `coalescing` decide what happens if an event with the same name
+// and key is still queued; see `enum event_coalescing`.
+void emit_event(struct layer *layer, const char *name, const char *key,
+        JSCValue *data, enum event_coalescing coalescing) {
+    struct event_queue *events = &layer->events;
+    if (!layer_is_subscribed(layer, name)) {
+        g_object_unref(data);
+        return;
+    }
+    ++event_stats.emitted;
+    HUDKIT_PROBE1(event_emitted, name);
+
+    if (coalescing != EVENT_QUEUE) {
+        for (int i = events->pending->len - 1; i >= 0; --i) {
+            struct pending_event *event =
+                &g_array_index(events->pending, struct pending_event, i);
+            if (strcmp(event->name, name) || g_strcmp0(event->key, key))
+                continue;
+            JSCValue *old_data = event->data;
+            if (coalescing == EVENT_ACCUMULATE) {
+                event->data = accumulate_event_data(old_data, data);
+                g_object_unref(data);
+            } else {
+                event->data = data;
             }
+            g_object_unref(old_data);
+            ++event_stats.coalesced;
+            return;
         }
+    }
 
-        GdkRectangle rect = rectangles[i];
-        g_string_append_printf(response_buffer,
-                "',x:%i,y:%i,width:%i,height:%i},",
-                rect.x, rect.y, rect.width, rect.height);
+    if (events->pending->len >= MAX_PENDING_EVENTS) {
+        if (event_stats.dropped++ == 0)
+            g_warning("Page isn't taking events; dropping new ones");
+        g_object_unref(data);
+        return;
     }
-    g_string_append(response_buffer, "]");
 
-    // Discard the GString structure and take ownership of the underlying
-    // cstring memory.
-    char *finished_buffer = g_string_free(response_buffer, FALSE);
-    call_js_callback(web_view, callbackId, finished_buffer);
-    g_free(finished_buffer);
-    free(rectangles);
+    struct pending_event event = {
+        .name = g_strdup(name),
+        .key = g_strdup(key),
+        .data = data,
+        .queued_at = g_get_monotonic_time(),
+    };
+    g_array_append_val(events->pending, event);
+    schedule_event_delivery(layer);
 }
 
-void on_js_call_set_clickable_areas(WebKitUserContentManager *manager,
-        WebKitJavascriptResult *sentData,
-        gpointer arg) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(arg);
-    JSCValue *jsValue = webkit_javascript_result_get_js_value(sentData);
-    //printf("%s\n", jsc_value_to_json(jsValue, 2));
-    int callbackId = jsc_value_to_int32(jsc_value_object_get_property(jsValue, "id"));
-    int nRectangles = jsc_value_to_int32(
-            jsc_value_object_get_property(
-                jsc_value_object_get_property(jsValue, "rectangles"),
-                "length"));
-    //printf("nRectangles %i\n", nRectangles);
-
-    g_array_set_size(user_defined_input_rects, nRectangles);
-
-    JSCValue *jsRectangles = jsc_value_object_get_property(jsValue, "rectangles");
-    for (int i = 0; i < user_defined_input_rects->len; ++i) {
-        JSCValue *jsRect = jsc_value_object_get_property_at_index(jsRectangles, i);
-        cairo_rectangle_int_t *rect = &g_array_index(
-                user_defined_input_rects, GdkRectangle, i);
-
-        // Anything undefined is interpreted by `jsc_value_to_int32` as 0.
-        rect->x = jsc_value_to_int32(
-                 jsc_value_object_get_property(jsRect, "x"));
-        rect->y = jsc_value_to_int32(
-                 jsc_value_object_get_property(jsRect, "y"));
-        rect->width = jsc_value_to_int32(
-                 jsc_value_object_get_property(jsRect, "width"));
-        rect->height = jsc_value_to_int32(
-                jsc_value_object_get_property(jsRect, "height"));
-    }
-
-    realize_input_shape();
-
-    call_js_callback(web_view, callbackId, "");
-}
-void on_js_call_show_inspector(WebKitUserContentManager *manager,
-        WebKitJavascriptResult *sentData,
-        gpointer arg) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(arg);
-    JSCValue *jsValue = webkit_javascript_result_get_js_value(sentData);
-    int callbackId = jsc_value_to_int32(jsc_value_object_get_property(jsValue, "id"));
-    bool startAttached = jsc_value_to_boolean(
-            jsc_value_object_get_property(jsValue, "shouldAttachToWindow"));
+// Emits the event to every layer of the overlay.
+void emit_event_to_layers(struct overlay *overlay, const char *name,
+        const char *key, JSCValue *data, enum event_coalescing coalescing) {
+    for (int i = 0; i < overlay->layers->len; ++i)
+        emit_event(g_ptr_array_index(overlay->layers, i), name, key,
+                g_object_ref(data), coalescing);
+    g_object_unref(data);
+}
 
-    WebKitWebInspector *inspector = webkit_web_view_get_inspector(
-            WEBKIT_WEB_VIEW(web_view));
-    show_inspector(startAttached);
+// Emits the event to every page, in every overlay.
+void emit_event_to_all(const char *name, const char *key, JSCValue *data,
+        enum event_coalescing coalescing) {
+    for (int i = 0; i < overlays->len; ++i)
+        emit_event_to_layers(g_ptr_array_index(overlays, i), name, key,
+                g_object_ref(data), coalescing);
+    g_object_unref(data);
+}
 
-    call_js_callback(web_view, callbackId, "");
+//
+// Frame rate limiting
+//
+
+// WebKit only paints when the page changes something, and pages that animate
+// mostly do that from requestAnimationFrame callbacks, which run at the
+// monitor's refresh rate.  A HUD showing a clock doesn't need that, so the
+// bootstrap script throttles those callbacks to a limit we send it as the
+// `frame-rate-limit` event.  The limit is whichever is lowest of: the page's
+// own (from `Hudkit.setFrameRateLimit`), or --max-fps if it hasn't set one,
+// and the adaptive limit.  0 means no limit.
+
+// From --max-fps.
+double max_fps = 0;
+
+// From --cpu-budget, in percent of one core.  If nonzero, the adaptive limit
+// is lowered while hudkit (with its WebKit processes) uses more CPU than
+// this, and raised again once it doesn't.
+double cpu_budget_percent = 0;
+double adaptive_fps_limit = 0;
+
+#define ADAPTIVE_FPS_FLOOR 5
+// Where the adaptive limit starts from if nothing else limits the frame rate.
+#define ADAPTIVE_FPS_CEILING 60
+#define CPU_SAMPLE_INTERVAL_MS 1000
+
+// The limit only slows requestAnimationFrame callbacks.  If what's using the
+// CPU is CSS animations, timers, or video, lowering it just starves the pages
+// that do cooperate, without saving anything.  So each cut is checked against
+// the next sample: unless CPU use is under budget, or went down by at least
+// CPU_CUT_MIN_SAVING of what it was, the cut is undone, and no more are tried
+// for CPU_CUT_HOLDOFF_SAMPLES samples.
+#define CPU_CUT_MIN_SAVING 0.1
+#define CPU_CUT_HOLDOFF_SAMPLES 30
+
+double layer_fps_limit(struct layer *layer) {
+    double limit = layer->page_fps_limit >= 0
+        ? layer->page_fps_limit : max_fps;
+    if (adaptive_fps_limit > 0 && (limit == 0 || adaptive_fps_limit < limit))
+        limit = adaptive_fps_limit;
+    return limit;
 }
 
+void emit_frame_rate_limit(struct layer *layer) {
+    emit_event(layer, "frame-rate-limit", NULL,
+            jsc_value_new_number(native_js_context,
+                layer_fps_limit(layer)),
+            EVENT_LATEST);
+}
 
-void on_inspector_size_allocate(GtkWidget *inspector_web_view,
-        GdkRectangle *allocation,
+// While any of an overlay's pages listen for `frame` events, the overlay's
+// frame clock is kept ticking, and each tick is passed on to them (at most at
+// their frame rate limit), so they can pace animations to the display
+// instead of to timers.
+static gboolean on_frame_event_tick(GtkWidget *widget, GdkFrameClock *clock,
         gpointer user_data) {
-    // Whenever the inspector (which when this is called is attached to the
-    // overlay window) moves or is resized, change the input shape to "follow"
-    // it, so that it always remains clickable.
+    struct overlay *overlay = user_data;
+    gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+    gint64 refresh_interval = 0;
+    gdk_frame_clock_get_refresh_info(clock, frame_time,
+            &refresh_interval, NULL);
+
+    for (int i = 0; i < overlay->layers->len; ++i) {
+        struct layer *layer = g_ptr_array_index(overlay->layers, i);
+        if (!layer_is_subscribed(layer, "frame")) continue;
+        // A little slack, since ticks don't arrive exactly on time.
+        double limit = layer_fps_limit(layer);
+        if (limit > 0 && frame_time - layer->last_frame_event_time
+                < G_USEC_PER_SEC / limit - 2000)
+            continue;
+        layer->last_frame_event_time = frame_time;
+
+        JSCValue *data = jsc_value_new_object(native_js_context, NULL, NULL);
+        js_set_number(data, "frame", gdk_frame_clock_get_frame_counter(clock));
+        js_set_number(data, "timeMs", frame_time / 1000.0);
+        js_set_number(data, "refreshIntervalMs", refresh_interval / 1000.0);
+        emit_event(layer, "frame", NULL, data, EVENT_LATEST);
+    }
+    return G_SOURCE_CONTINUE;
+}
 
-    attached_inspector_input_rect.x = allocation->x;
-    attached_inspector_input_rect.y = allocation->y;
-    attached_inspector_input_rect.width = allocation->width;
-    attached_inspector_input_rect.height = allocation->height;
+// Starts or stops the overlay's `frame` events, depending on whether anyone
+// listens for them.  Call whenever its pages' subscriptions might have
+// changed.
+void update_frame_events(struct overlay *overlay) {
+    bool wanted = FALSE;
+    for (int i = 0; i < overlay->layers->len; ++i)
+        if (layer_is_subscribed(g_ptr_array_index(overlay->layers, i),
+                    "frame"))
+            wanted = TRUE;
+    if (wanted && !overlay->frame_event_tick_id) {
+        overlay->frame_event_tick_id = gtk_widget_add_tick_callback(
+                overlay->window, on_frame_event_tick, overlay, NULL);
+    } else if (!wanted && overlay->frame_event_tick_id) {
+        gtk_widget_remove_tick_callback(overlay->window,
+                overlay->frame_event_tick_id);
+        overlay->frame_event_tick_id = 0;
+    }
+}
 
-    realize_input_shape();
+// Calls `callback` with process `pid`, and then each of its descendants.
+//
+// WebKit does its work in child processes (grandchildren, if they're
+// sandboxed with bubblewrap), so looking only at our own would miss most of
+// it.
+static void for_each_process_in_tree(const char *pid,
+        void (*callback)(const char *pid, gpointer user_data),
+        gpointer user_data) {
+    callback(pid, user_data);
+
+    // Children can be started from any of the process's threads, and each
+    // thread lists its own.
+    char *task_path = g_strdup_printf("/proc/%s/task", pid);
+    GDir *tasks = g_dir_open(task_path, 0, NULL);
+    if (tasks) {
+        const char *task;
+        while ((task = g_dir_read_name(tasks))) {
+            char *children_path = g_strdup_printf("%s/%s/children",
+                    task_path, task);
+            char *children = NULL;
+            if (g_file_get_contents(children_path, &children, NULL, NULL)) {
+                char **child_pids = g_strsplit(g_strstrip(children), " ", -1);
+                for (char **child = child_pids; *child; ++child)
+                    if (**child)
+                        for_each_process_in_tree(*child, callback, user_data);
+                g_strfreev(child_pids);
+                g_free(children);
+            }
+            g_free(children_path);
+        }
+        g_dir_close(tasks);
+    }
+    g_free(task_path);
 }
 
-gulong inspector_size_allocate_handler_id = 0;
+// Adds the CPU time used by process `pid` to `*ticks`, in clock ticks.
+static void add_cpu_ticks(const char *pid, gpointer user_data) {
+    guint64 *ticks = user_data;
+    char *path = g_strdup_printf("/proc/%s/stat", pid);
+    char *stat = NULL;
+    if (g_file_get_contents(path, &stat, NULL, NULL)) {
+        // The process name in parentheses may contain spaces, so skip past
+        // it before counting fields.  utime and stime are the 14th and 15th.
+        char *rest = strrchr(stat, ')');
+        unsigned long long utime, stime;
+        if (rest && sscanf(rest + 2,
+                    "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                    &utime, &stime) == 2)
+            *ticks += utime + stime;
+        g_free(stat);
+    }
+    g_free(path);
+}
 
-void show_attached_inspector_no_keyboard_advice(WebKitWebView *web_view) {
-    webkit_web_view_evaluate_javascript(
-        web_view,
-        "console.info('Note that when the Web Inspector is"
-            " attached to the Hudkit window, you cannot type into it, because"
-            " the overlay window does not receive keyboard events.  To type"
-            " into this console, detach the Inspector into its own window.')",
-        -1, // `length` (-1 indicates a NULL-terminated string)
-        NULL, // `world_name` (NULL indicates default)
-        NULL, // `source_uri` (NULL indicates there's no associated file)
-        NULL, // `cancellable` (NULL indicates we don't care)
-        on_js_call_finished, // callback
-        NULL // `user_data`
-    );
+static void set_adaptive_fps_limit(double limit) {
+    if (limit == adaptive_fps_limit) return;
+    adaptive_fps_limit = limit;
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        for (int j = 0; j < overlay->layers->len; ++j)
+            emit_frame_rate_limit(g_ptr_array_index(overlay->layers, j));
+    }
 }
-bool on_inspector_attach(WebKitWebInspector *inspector, gpointer user_data) {
-    // When the web inspector attaches to the overlay window, begin tracking
-    // its allocated position on screen.
-    WebKitWebView *web_view = (WebKitWebView *) user_data;
 
-    WebKitWebViewBase *inspector_web_view = webkit_web_inspector_get_web_view(
-            inspector);
-    inspector_size_allocate_handler_id =
-        g_signal_connect(GTK_WIDGET(inspector_web_view), "size-allocate",
-                G_CALLBACK(on_inspector_size_allocate), NULL);
+static gboolean on_cpu_sample(gpointer user_data) {
+    static guint64 last_ticks = 0;
+    static gint64 last_time = 0;
+    // If the last sample lowered the limit, the CPU use then and the limit
+    // from before, so the cut can be undone if it didn't help.
+    static double percent_before_cut = 0;
+    static double limit_before_cut = 0;
+    static int cut_holdoff = 0;
+
+    guint64 ticks = 0;
+    char *self = g_strdup_printf("%d", getpid());
+    for_each_process_in_tree(self, add_cpu_ticks, &ticks);
+    g_free(self);
+    gint64 now = g_get_monotonic_time();
+
+    // If a child process exited since last time, its CPU time is gone from
+    // the total, so this sample is meaningless.  Just start over.
+    if (last_time && ticks >= last_ticks) {
+        double cpu_seconds = (ticks - last_ticks) / (double)sysconf(_SC_CLK_TCK);
+        double percent = 100 * cpu_seconds / ((now - last_time) / 1e6);
+
+        // Whatever layer is allowed the highest frame rate is the one most
+        // likely to be using the CPU, so that's where we step from.
+        double highest = 0;
+        for (int i = 0; i < overlays->len; ++i) {
+            struct overlay *overlay = g_ptr_array_index(overlays, i);
+            for (int j = 0; j < overlay->layers->len; ++j) {
+                double limit = layer_fps_limit(
+                        g_ptr_array_index(overlay->layers, j));
+                if (limit == 0) limit = ADAPTIVE_FPS_CEILING;
+                if (limit > highest) highest = limit;
+            }
+        }
 
-    static GOnce show_no_keyboard_advice_once = G_ONCE_INIT;
-    g_once(&show_no_keyboard_advice_once,
-            (void * (*)(void *))show_attached_inspector_no_keyboard_advice,
-            web_view);
+        if (cut_holdoff > 0) --cut_holdoff;
+        bool cut_helped = percent_before_cut == 0 ||
+            percent <= cpu_budget_percent ||
+            percent <= percent_before_cut * (1 - CPU_CUT_MIN_SAVING);
+        percent_before_cut = 0;
+
+        if (!cut_helped) {
+            set_adaptive_fps_limit(limit_before_cut);
+            cut_holdoff = CPU_CUT_HOLDOFF_SAMPLES;
+        } else if (percent > cpu_budget_percent) {
+            double lowered = highest * 0.75;
+            if (lowered < ADAPTIVE_FPS_FLOOR) lowered = ADAPTIVE_FPS_FLOOR;
+            if (cut_holdoff == 0 && lowered < highest) {
+                percent_before_cut = percent;
+                limit_before_cut = adaptive_fps_limit;
+                set_adaptive_fps_limit(lowered);
+            }
+        } else if (adaptive_fps_limit > 0 &&
+                percent < cpu_budget_percent * 0.75) {
+            // Comfortably under budget, so carefully raise the limit, until
+            // it's higher than the others and can be lifted entirely.  The
+            // margin keeps it from flapping up and down around the budget.
+            double raised = adaptive_fps_limit * 1.25;
+            double others = max_fps > 0 ? max_fps : ADAPTIVE_FPS_CEILING;
+            set_adaptive_fps_limit(raised >= others ? 0 : raised);
+        }
+    }
 
-    return FALSE; // Allow attach
+    last_ticks = ticks;
+    last_time = now;
+    return G_SOURCE_CONTINUE;
+}
+
+//
+// Frame export
+//
+
+// With --export-frames, each overlay publishes what it renders, alpha and
+// all, into POSIX shared memory, so a streaming or recording program can
+// composite it itself instead of capturing the whole screen and keying the
+// overlay back out.
+//
+// The shared memory starts with a `struct frame_export_header`, followed by
+// FRAME_EXPORT_SLOTS slots, each holding one frame as cairo's ARGB32:
+// premultiplied alpha, native-endian 32-bit pixels, `stride` bytes per row.
+// Frames are numbered from 1 and frame n goes into slot n % FRAME_EXPORT_SLOTS,
+// so a reader has the time of FRAME_EXPORT_SLOTS - 1 more frames to read the
+// latest one in place.  While a slot is being written, its `frame` is 0;
+// when done, it's the frame's number.  A reader that sees the same nonzero
+// `frame` before and after reading a slot has read that whole frame.
+//
+// A slot is written over from the frame it held FRAME_EXPORT_SLOTS frames
+// ago, so only rows that were redrawn since then are rendered into it again.
+
+char *export_frames_name = NULL;
+
+#define FRAME_EXPORT_SLOTS 3
+#define FRAME_EXPORT_MAGIC "HUDKITFR"
+#define FRAME_EXPORT_VERSION 1
+
+struct frame_export_header {
+    char magic[8];
+    uint32_t version;
+    // Nonzero once this shared memory is no longer written, such as when the
+    // overlay was resized.  Readers should open it again by name.
+    uint32_t stale;
+    uint32_t width, height, stride;
+    uint32_t slot_count;
+    // From the start of the shared memory, to the first slot, and from each
+    // slot to the next.
+    uint64_t slots_offset, slot_size;
+    // The number of the newest complete frame, or 0 if there isn't one yet.
+    uint64_t latest_frame;
+    struct {
+        uint64_t frame;
+        // When it was rendered, in g_get_monotonic_time microseconds.
+        int64_t time_us;
+    } slots[FRAME_EXPORT_SLOTS];
+};
+
+struct frame_export {
+    char *name;
+    struct frame_export_header *header;
+    size_t size;
+    int width, height;
+    uint64_t frame;
+    // For each slot, the rows redrawn since the frame in it, as full-width
+    // rectangles.
+    cairo_region_t *damage[FRAME_EXPORT_SLOTS];
+    GdkFrameClock *frame_clock;
+    gulong draw_handler_id, after_paint_handler_id;
+};
+
+static struct {
+    guint64 frames, rows;
+} frame_export_stats;
+
+// Unmaps and removes the shared memory, after telling any readers.
+static void frame_export_unmap(struct frame_export *export) {
+    if (!export->header) return;
+    __atomic_store_n(&export->header->stale, 1, __ATOMIC_RELEASE);
+    munmap(export->header, export->size);
+    shm_unlink(export->name);
+    export->header = NULL;
+}
+
+// Creates the shared memory for frames of the given size.
+static bool frame_export_map(struct frame_export *export,
+        int width, int height) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t slots_offset = (sizeof(struct frame_export_header) + page - 1)
+        / page * page;
+    size_t slot_size = ((size_t)stride * height + 63) / 64 * 64;
+    size_t size = slots_offset + slot_size * FRAME_EXPORT_SLOTS;
+
+    // Replaced whole, so a reader never sees a header being filled in.
+    shm_unlink(export->name);
+    int fd = shm_open(export->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        g_warning("Can't create shared memory %s for exporting frames: %s",
+                export->name, g_strerror(errno));
+        return false;
+    }
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        g_warning("Can't map shared memory %s for exporting frames: %s",
+                export->name, g_strerror(errno));
+        close(fd);
+        shm_unlink(export->name);
+        return false;
+    }
+    close(fd);
+
+    // Fresh shared memory is zeroed, so every slot starts out empty.
+    struct frame_export_header *header = memory;
+    memcpy(header->magic, FRAME_EXPORT_MAGIC, sizeof header->magic);
+    header->version = FRAME_EXPORT_VERSION;
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->slot_count = FRAME_EXPORT_SLOTS;
+    header->slots_offset = slots_offset;
+    header->slot_size = slot_size;
+
+    export->header = header;
+    export->size = size;
+    export->width = width;
+    export->height = height;
+    cairo_rectangle_int_t all = { 0, 0, width, height };
+    for (int i = 0; i < FRAME_EXPORT_SLOTS; ++i) {
+        if (export->damage[i]) cairo_region_destroy(export->damage[i]);
+        export->damage[i] = cairo_region_create_rectangle(&all);
+    }
+    return true;
+}
+
+// Notes which rows the window redrew, for every slot.
+static gboolean on_export_window_draw(GtkWidget *widget, cairo_t *cr,
+        gpointer user_data) {
+    struct overlay *overlay = user_data;
+    struct frame_export *export = overlay->frame_export;
+    int width = gtk_widget_get_allocated_width(widget);
+
+    double x1, y1, x2, y2;
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+    cairo_rectangle_int_t rows = { 0, floor(y1), width, ceil(y2) - floor(y1) };
+    for (int i = 0; i < FRAME_EXPORT_SLOTS; ++i) {
+        if (!export->damage[i]) export->damage[i] = cairo_region_create();
+        cairo_region_union_rectangle(export->damage[i], &rows);
+    }
+    return FALSE;
+}
+
+// Once a frame is painted, renders what was redrawn of it into the next
+// slot.
+static void on_export_after_paint(GdkFrameClock *clock, gpointer user_data) {
+    struct overlay *overlay = user_data;
+    struct frame_export *export = overlay->frame_export;
+    int width = gtk_widget_get_allocated_width(overlay->stack);
+    int height = gtk_widget_get_allocated_height(overlay->stack);
+    if (width <= 0 || height <= 0) return;
+
+    if (width != export->width || height != export->height) {
+        frame_export_unmap(export);
+        // If this fails, it's not tried again until the size changes.
+        export->width = width;
+        export->height = height;
+        if (!frame_export_map(export, width, height)) return;
+    }
+    if (!export->header) return;
+
+    uint64_t frame = export->frame + 1;
+    int slot = frame % FRAME_EXPORT_SLOTS;
+    cairo_region_t *damage = export->damage[slot];
+    cairo_rectangle_int_t bounds = { 0, 0, width, height };
+    cairo_region_intersect_rectangle(damage, &bounds);
+    // Nothing was redrawn, so there's no new frame.
+    if (cairo_region_is_empty(damage)) return;
+    gint64 start = g_get_monotonic_time();
+    export->frame = frame;
+
+    struct frame_export_header *header = export->header;
+    __atomic_store_n(&header->slots[slot].frame, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    unsigned char *pixels = (unsigned char *)header + header->slots_offset
+        + header->slot_size * slot;
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(pixels,
+            CAIRO_FORMAT_ARGB32, width, height, header->stride);
+    cairo_t *cr = cairo_create(surface);
+    gdk_cairo_region(cr, damage);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    for (int i = 0; i < overlay->layers->len; ++i)
+        ((struct layer *)g_ptr_array_index(overlay->layers, i))
+            ->drawing_for_analysis = TRUE;
+    gtk_widget_draw(overlay->stack, cr);
+    for (int i = 0; i < overlay->layers->len; ++i)
+        ((struct layer *)g_ptr_array_index(overlay->layers, i))
+            ->drawing_for_analysis = FALSE;
+    cairo_destroy(cr);
+    cairo_surface_finish(surface);
+    cairo_surface_destroy(surface);
+
+    header->slots[slot].time_us = start;
+    __atomic_store_n(&header->slots[slot].frame, frame, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest_frame, frame, __ATOMIC_RELEASE);
+
+    cairo_rectangle_int_t rows;
+    cairo_region_get_extents(damage, &rows);
+    cairo_region_destroy(damage);
+    export->damage[slot] = cairo_region_create();
+    ++frame_export_stats.frames;
+    frame_export_stats.rows += rows.height;
+    latency_stat_record(STAT_FRAME_EXPORT, start);
+    HUDKIT_PROBE2(frame_exported, frame, rows.height);
+}
+
+static bool frame_export_name_taken(const char *name) {
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        if (overlay->frame_export &&
+                !strcmp(overlay->frame_export->name, name))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Starts exporting the overlay's frames.  With --per-monitor, each overlay's
+// shared memory is named after its monitor's connector (as GDK's monitor
+// model, like "DP-1"), as "<name>.<connector>", so a capture program finds
+// the same monitor under the same name, whatever else is plugged in or out.
+// If the connector isn't known, or another overlay already has that name,
+// it's "<name>.<serial>" instead, from a counter that only goes up, so it's
+// never one another overlay had.
+void frame_export_start(struct overlay *overlay) {
+    if (!export_frames_name) return;
+    static int serial = 0;
+    struct frame_export *export = g_new0(struct frame_export, 1);
+
+    if (overlay->monitor) {
+        const char *model = gdk_monitor_get_model(overlay->monitor);
+        if (model && *model) {
+            // Shared memory names can't have more slashes in them.
+            char *connector = g_strcanon(g_strdup(model),
+                    G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_.", '_');
+            export->name = g_strdup_printf("%s.%s", export_frames_name,
+                    connector);
+            g_free(connector);
+        }
+        while (!export->name || frame_export_name_taken(export->name)) {
+            g_free(export->name);
+            export->name = g_strdup_printf("%s.%d", export_frames_name,
+                    ++serial);
+        }
+    } else {
+        export->name = g_strdup(export_frames_name);
+    }
+    overlay->frame_export = export;
+
+    export->draw_handler_id = g_signal_connect_after(overlay->window, "draw",
+            G_CALLBACK(on_export_window_draw), overlay);
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(overlay->window);
+    if (clock) {
+        export->frame_clock = g_object_ref(clock);
+        export->after_paint_handler_id = g_signal_connect(clock,
+                "after-paint", G_CALLBACK(on_export_after_paint), overlay);
+    }
+}
+
+void frame_export_stop(struct overlay *overlay) {
+    struct frame_export *export = overlay->frame_export;
+    if (!export) return;
+    g_signal_handler_disconnect(overlay->window, export->draw_handler_id);
+    if (export->frame_clock) {
+        g_signal_handler_disconnect(export->frame_clock,
+                export->after_paint_handler_id);
+        g_object_unref(export->frame_clock);
+    }
+    frame_export_unmap(export);
+    for (int i = 0; i < FRAME_EXPORT_SLOTS; ++i)
+        if (export->damage[i]) cairo_region_destroy(export->damage[i]);
+    g_free(export->name);
+    g_free(export);
+    overlay->frame_export = NULL;
+}
+
+static void remove_exported_frames(void) {
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        if (overlay->frame_export) frame_export_unmap(overlay->frame_export);
+    }
+}
+
+//
+// Headless mode
+//
+
+// With --headless, the overlay is a GtkOffscreenWindow that's never shown on
+// screen, and pages see a virtual monitor layout instead of the real one.  So
+// there's no need for a compositor, and the results don't depend on what
+// else is on the screen, which is what benchmarks and automated tests want.
+// Pages still use the whole JavaScript API as normal.
+//
+// Every frame the overlay draws can be written out as a checksum of its
+// pixels (--headless-checksums) and as a PNG (--headless-png).
+
+// The virtual monitors, as struct monitor_info, or NULL if not headless.
+GArray *headless_monitors = NULL;
+// From --headless-checksums, opened.
+FILE *headless_checksums_file = NULL;
+// From --headless-png.
+char *headless_png_dir = NULL;
+// From --headless-frames.  If nonzero, we exit after this many frames.
+guint64 headless_frame_limit = 0;
+guint64 headless_frames = 0;
+
+static void monitor_info_clear(gpointer data);
+
+// Parses a monitor layout like "1920x1080,1280x1024+1920+0": each monitor as
+// <width>x<height>, optionally followed by +<x>+<y>.  A monitor without a
+// position is put to the right of the one before it.  Returns NULL if it's
+// not valid.
+static GArray *parse_monitor_layout(const char *layout) {
+    GArray *monitors = g_array_new(FALSE, TRUE, sizeof(struct monitor_info));
+    g_array_set_clear_func(monitors, monitor_info_clear);
+    char **specs = g_strsplit(layout, ",", -1);
+    int next_x = 0;
+    for (int i = 0; specs[i]; ++i) {
+        struct monitor_info info = { 0 };
+        int n_read = 0;
+        int n = sscanf(specs[i], "%dx%d%n+%d+%d%n",
+                &info.geometry.width, &info.geometry.height, &n_read,
+                &info.geometry.x, &info.geometry.y, &n_read);
+        if ((n != 2 && n != 4) || specs[i][n_read] != '\0'
+                || info.geometry.width <= 0 || info.geometry.height <= 0) {
+            g_array_free(monitors, TRUE);
+            monitors = NULL;
+            break;
+        }
+        if (n == 2) info.geometry.x = next_x;
+        next_x = info.geometry.x + info.geometry.width;
+        info.name = g_strdup_printf("headless-%d", i);
+        info.scale = 1;
+        info.refresh_rate = 60;
+        g_array_append_val(monitors, info);
+    }
+    g_strfreev(specs);
+    if (monitors && monitors->len == 0) {
+        g_array_free(monitors, TRUE);
+        monitors = NULL;
+    }
+    return monitors;
+}
+
+static gboolean on_headless_window_draw(GtkWidget *widget, cairo_t *cr,
+        gpointer user_data) {
+    struct overlay *overlay = user_data;
+    overlay->drawn_since_capture = TRUE;
+    return FALSE;
+}
+
+// Writes out the frame the overlay just drew.
+static void headless_capture(struct overlay *overlay) {
+    overlay->drawn_since_capture = FALSE;
+    cairo_surface_t *surface = gtk_offscreen_window_get_surface(
+            GTK_OFFSCREEN_WINDOW(overlay->window));
+    if (!surface) return;
+    ++headless_frames;
+
+    if (headless_checksums_file || headless_png_dir) {
+        cairo_surface_t *image = cairo_surface_map_to_image(surface, NULL);
+        int width = cairo_image_surface_get_width(image);
+        int height = cairo_image_surface_get_height(image);
+
+        if (headless_checksums_file) {
+            // Row by row, since rows may have padding at the end that isn't
+            // part of the picture.
+            const unsigned char *data = cairo_image_surface_get_data(image);
+            int stride = cairo_image_surface_get_stride(image);
+            GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+            for (int y = 0; y < height; ++y)
+                g_checksum_update(checksum, data + y * stride, width * 4);
+            fprintf(headless_checksums_file,
+                    "{\"frame\":%" G_GUINT64_FORMAT ",\"timeMs\":%.3f,"
+                    "\"width\":%d,\"height\":%d,\"checksum\":\"%s\"}\n",
+                    headless_frames,
+                    (g_get_monotonic_time() - startup_time) / 1000.0,
+                    width, height, g_checksum_get_string(checksum));
+            fflush(headless_checksums_file);
+            g_checksum_free(checksum);
+        }
+        if (headless_png_dir) {
+            char *path = g_strdup_printf("%s/frame-%06" G_GUINT64_FORMAT
+                    ".png", headless_png_dir, headless_frames);
+            cairo_status_t status = cairo_surface_write_to_png(image, path);
+            if (status != CAIRO_STATUS_SUCCESS)
+                g_warning("Can't write %s: %s", path,
+                        cairo_status_to_string(status));
+            g_free(path);
+        }
+        cairo_surface_unmap_image(surface, image);
+    }
+
+    if (headless_frame_limit && headless_frames >= headless_frame_limit)
+        gtk_main_quit();
+}
+
+//
+// Memory budget
+//
+
+// From --memory-limit, in MiB, for each web process.  0 means no limit.
+//
+// WebKit is told about it through its memory pressure settings, so a web
+// process frees caches as it gets close to it, and is killed if it goes
+// over.  We also watch the web processes' RSS ourselves, and step in before
+// it comes to that: first by asking for a JavaScript garbage collection,
+// then, if that didn't help, by restarting the web processes ourselves.
+double memory_limit_mib = 0;
+
+#define MEMORY_SAMPLE_INTERVAL_MS 2000
+// Fractions of the limit at which we garbage collect, and restart.
+#define MEMORY_GC_THRESHOLD 0.75
+#define MEMORY_RESTART_THRESHOLD 0.9
+
+struct {
+    guint64 garbage_collections;
+    // Web processes restarted, for any reason.
+    guint64 restarts;
+    // The largest RSS any web process has been seen at, in KiB.  Only
+    // sampled with --memory-limit.
+    guint64 peak_rss_kib;
+} memory_stats;
+
+// If process `pid` is a WebKit web process, raises `*max_rss_kib` to its RSS
+// if that's larger.
+static void max_web_process_rss(const char *pid, gpointer user_data) {
+    guint64 *max_rss_kib = user_data;
+
+    // The kernel cuts names off at 15 characters.
+    char *path = g_strdup_printf("/proc/%s/comm", pid);
+    char *name = NULL;
+    bool is_web_process = g_file_get_contents(path, &name, NULL, NULL) &&
+        g_str_has_prefix(name, "WebKitWebProces");
+    g_free(name);
+    g_free(path);
+    if (!is_web_process) return;
+
+    path = g_strdup_printf("/proc/%s/statm", pid);
+    char *statm = NULL;
+    unsigned long long resident_pages;
+    if (g_file_get_contents(path, &statm, NULL, NULL) &&
+            sscanf(statm, "%*u %llu", &resident_pages) == 1) {
+        guint64 rss_kib = resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+        if (rss_kib > *max_rss_kib) *max_rss_kib = rss_kib;
+    }
+    g_free(statm);
+    g_free(path);
+}
+
+static gboolean on_memory_sample(gpointer user_data) {
+    // Whether we've garbage collected since going over the threshold for it.
+    static bool collected = FALSE;
+
+    guint64 rss_kib = 0;
+    char *self = g_strdup_printf("%d", getpid());
+    for_each_process_in_tree(self, max_web_process_rss, &rss_kib);
+    g_free(self);
+    if (rss_kib > memory_stats.peak_rss_kib)
+        memory_stats.peak_rss_kib = rss_kib;
+    HUDKIT_PROBE1(web_process_rss, rss_kib);
+
+    double limit_kib = memory_limit_mib * 1024;
+    if (rss_kib >= limit_kib * MEMORY_RESTART_THRESHOLD && collected) {
+        // We can't tell which web views a web process is for, so they all
+        // get restarted.  Each gets reloaded by `on_web_process_terminated`.
+        g_warning("Web process is using %.1f MiB of its %.0f MiB budget, even"
+                " after garbage collection; restarting web processes",
+                rss_kib / 1024.0, memory_limit_mib);
+        for (int i = 0; i < overlays->len; ++i) {
+            struct overlay *overlay = g_ptr_array_index(overlays, i);
+            for (int j = 0; j < overlay->layers->len; ++j) {
+                struct layer *layer = g_ptr_array_index(overlay->layers, j);
+                webkit_web_view_terminate_web_process(layer->web_view);
+            }
+        }
+        collected = FALSE;
+    } else if (rss_kib >= limit_kib * MEMORY_GC_THRESHOLD) {
+        if (!collected) {
+            webkit_web_context_garbage_collect_javascript_objects(wk_context);
+            ++memory_stats.garbage_collections;
+            collected = TRUE;
+        }
+    } else {
+        collected = FALSE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void js_set_histogram(JSCValue *object, const char *name,
+        guint64 *histogram, int n_buckets) {
+    GPtrArray *counts = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < n_buckets; ++i)
+        g_ptr_array_add(counts,
+                jsc_value_new_number(native_js_context, histogram[i]));
+    JSCValue *value = jsc_value_new_array_from_garray(native_js_context,
+            counts);
+    g_ptr_array_unref(counts);
+    jsc_value_object_set_property(object, name, value);
+    g_object_unref(value);
+}
+
+// All the counters and latencies, as pages see them.
+JSCValue *js_stats_new(void) {
+    JSCValue *stats = jsc_value_new_object(native_js_context, NULL, NULL);
+
+    JSCValue *counters = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_number(counters, "inputShapeRequested", input_shape_stats.requested);
+    js_set_number(counters, "inputShapeCoalesced", input_shape_stats.coalesced);
+    js_set_number(counters, "inputShapeSkipped", input_shape_stats.skipped);
+    js_set_number(counters, "inputShapeApplied", input_shape_stats.applied);
+    js_set_number(counters, "eventsEmitted", event_stats.emitted);
+    js_set_number(counters, "eventsCoalesced", event_stats.coalesced);
+    js_set_number(counters, "eventsDropped", event_stats.dropped);
+    js_set_number(counters, "eventsDelivered", event_stats.delivered);
+    js_set_number(counters, "eventBatches", event_stats.batches);
+    js_set_number(counters, "garbageCollections",
+            memory_stats.garbage_collections);
+    js_set_number(counters, "webProcessRestarts", memory_stats.restarts);
+    js_set_number(counters, "webProcessPeakRssKiB", memory_stats.peak_rss_kib);
+    js_set_number(counters, "framesExported", frame_export_stats.frames);
+    js_set_number(counters, "exportedRows", frame_export_stats.rows);
+    jsc_value_object_set_property(stats, "counters", counters);
+    g_object_unref(counters);
+
+    JSCValue *latencies = jsc_value_new_object(native_js_context, NULL, NULL);
+    for (int i = 0; i < N_LATENCY_STATS; ++i) {
+        struct latency_stat *stat = &latency_stats[i];
+        JSCValue *value = jsc_value_new_object(native_js_context, NULL, NULL);
+        js_set_number(value, "count", stat->count);
+        js_set_number(value, "meanUs", stat->count
+                ? (double)stat->total_us / stat->count : 0);
+        js_set_number(value, "maxUs", stat->max_us);
+        js_set_histogram(value, "histogram", stat->histogram,
+                N_LATENCY_HISTOGRAM_BUCKETS);
+        jsc_value_object_set_property(latencies, latency_stat_names[i], value);
+        g_object_unref(value);
+    }
+    jsc_value_object_set_property(stats, "latencies", latencies);
+    g_object_unref(latencies);
+
+    GPtrArray *bounds = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < G_N_ELEMENTS(latency_histogram_bounds_us); ++i)
+        g_ptr_array_add(bounds, jsc_value_new_number(native_js_context,
+                    latency_histogram_bounds_us[i]));
+    JSCValue *value = jsc_value_new_array_from_garray(native_js_context,
+            bounds);
+    g_ptr_array_unref(bounds);
+    jsc_value_object_set_property(stats, "histogramBoundsUs", value);
+    g_object_unref(value);
+    return stats;
+}
+
+// From --stats-file.  If set, the stats are appended to it as a line of JSON
+// every STATS_DUMP_INTERVAL_S seconds.
+char *stats_file = NULL;
+#define STATS_DUMP_INTERVAL_S 10
+
+static gboolean on_stats_dump(gpointer user_data) {
+    FILE *file = fopen(stats_file, "a");
+    if (!file) {
+        g_warning("Can't open %s for stats; no longer writing them",
+                stats_file);
+        return G_SOURCE_REMOVE;
+    }
+    JSCValue *line = js_stats_new();
+    js_set_number(line, "time", g_get_real_time() / 1e6);
+    char *json = jsc_value_to_json(line, 0);
+    fprintf(file, "%s\n", json);
+    g_free(json);
+    g_object_unref(line);
+    fclose(file);
+    return G_SOURCE_CONTINUE;
+}
+
+//
+// Frame timing statistics
+//
+
+// Upper bounds of the histogram buckets for frame intervals and paint
+// durations, in milliseconds.  There's one more bucket than bounds: the last
+// one catches everything longer.  (I'd rather not have an Infinity bound here,
+// since that turns into null in JSON.)
+static const double frame_histogram_bounds_ms[] = {
+    4, 8, 12, 17, 20, 25, 34, 50, 67, 100, 250, 500
+};
+G_STATIC_ASSERT(G_N_ELEMENTS(frame_histogram_bounds_ms)
+        == N_FRAME_HISTOGRAM_BUCKETS - 1);
+
+// A gap between frames longer than this means the page just had nothing to
+// draw for a while, so it isn't counted as a slow frame.
+#define FRAME_IDLE_GAP_US G_USEC_PER_SEC
+
+// From --frame-stats-file.  If set, every overlay's frame stats are appended
+// to it as a line of JSON every FRAME_STATS_DUMP_INTERVAL_S seconds.
+char *frame_stats_file = NULL;
+#define FRAME_STATS_DUMP_INTERVAL_S 10
+
+static void frame_histogram_add(guint64 *histogram, double ms) {
+    int i = 0;
+    while (i < N_FRAME_HISTOGRAM_BUCKETS - 1
+            && ms > frame_histogram_bounds_ms[i]) ++i;
+    ++histogram[i];
+}
+
+static void on_frame_clock_before_paint(GdkFrameClock *clock,
+        gpointer user_data) {
+    struct overlay *overlay = user_data;
+    overlay->frame_stats.paint_start = g_get_monotonic_time();
+}
+
+static void on_frame_clock_after_paint(GdkFrameClock *clock,
+        gpointer user_data) {
+    struct overlay *overlay = user_data;
+    struct frame_stats *stats = &overlay->frame_stats;
+    if (!stats->paint_start) return;
+
+    double paint_ms = (g_get_monotonic_time() - stats->paint_start) / 1000.0;
+    stats->paint_start = 0;
+    ++stats->frames;
+    stats->paint_total_ms += paint_ms;
+    if (paint_ms > stats->paint_max_ms) stats->paint_max_ms = paint_ms;
+    frame_histogram_add(stats->paint_histogram, paint_ms);
+
+    // The frame clock's idea of the time, which is when the frame was
+    // started, not whenever we got around to running.
+    gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+    gint64 refresh_interval = 0;
+    gdk_frame_clock_get_refresh_info(clock, frame_time,
+            &refresh_interval, NULL);
+    stats->refresh_interval_us = refresh_interval;
+
+    gint64 interval = frame_time - stats->last_frame_time;
+    if (stats->last_frame_time && interval <= FRAME_IDLE_GAP_US) {
+        frame_histogram_add(stats->interval_histogram, interval / 1000.0);
+        // Every refresh interval that passed without a frame is a frame
+        // that was missed.  Rounded, since frame times jitter a bit.
+        if (refresh_interval > 0) {
+            gint64 refreshes = (interval + refresh_interval / 2)
+                / refresh_interval;
+            if (refreshes > 1) stats->missed_frames += refreshes - 1;
+        }
+    }
+    stats->last_frame_time = frame_time;
+
+    if (headless_monitors && overlay->drawn_since_capture)
+        headless_capture(overlay);
+}
+
+void frame_stats_connect(struct overlay *overlay) {
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(overlay->window);
+    if (!clock) return;
+    overlay->frame_clock = g_object_ref(clock);
+    overlay->before_paint_handler_id = g_signal_connect(clock,
+            "before-paint", G_CALLBACK(on_frame_clock_before_paint), overlay);
+    overlay->after_paint_handler_id = g_signal_connect(clock,
+            "after-paint", G_CALLBACK(on_frame_clock_after_paint), overlay);
+}
+
+void frame_stats_disconnect(struct overlay *overlay) {
+    if (!overlay->frame_clock) return;
+    g_signal_handler_disconnect(overlay->frame_clock,
+            overlay->before_paint_handler_id);
+    g_signal_handler_disconnect(overlay->frame_clock,
+            overlay->after_paint_handler_id);
+    g_object_unref(overlay->frame_clock);
+    overlay->frame_clock = NULL;
+}
+
+// The overlay's frame stats, as pages see them.
+JSCValue *js_frame_stats_new(struct overlay *overlay) {
+    struct frame_stats *stats = &overlay->frame_stats;
+    JSCValue *object = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_number(object, "frames", stats->frames);
+    js_set_number(object, "missedFrames", stats->missed_frames);
+    js_set_number(object, "refreshIntervalMs",
+            stats->refresh_interval_us / 1000.0);
+    js_set_number(object, "paintMeanMs", stats->frames
+            ? stats->paint_total_ms / stats->frames : 0);
+    js_set_number(object, "paintMaxMs", stats->paint_max_ms);
+
+    GPtrArray *bounds = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < G_N_ELEMENTS(frame_histogram_bounds_ms); ++i)
+        g_ptr_array_add(bounds, jsc_value_new_number(native_js_context,
+                    frame_histogram_bounds_ms[i]));
+    JSCValue *value = jsc_value_new_array_from_garray(native_js_context,
+            bounds);
+    g_ptr_array_unref(bounds);
+    jsc_value_object_set_property(object, "histogramBoundsMs", value);
+    g_object_unref(value);
+
+    js_set_histogram(object, "intervalHistogram", stats->interval_histogram,
+            N_FRAME_HISTOGRAM_BUCKETS);
+    js_set_histogram(object, "paintHistogram", stats->paint_histogram,
+            N_FRAME_HISTOGRAM_BUCKETS);
+    return object;
+}
+
+// Starts counting from scratch, such as when a page wants to measure some
+// particular stretch of time.
+void frame_stats_reset(struct overlay *overlay) {
+    struct frame_stats *stats = &overlay->frame_stats;
+    gint64 paint_start = stats->paint_start;
+    gint64 last_frame_time = stats->last_frame_time;
+    *stats = (struct frame_stats) {
+        .paint_start = paint_start,
+        .last_frame_time = last_frame_time,
+        .refresh_interval_us = stats->refresh_interval_us,
+    };
+}
+
+static gboolean on_frame_stats_dump(gpointer user_data) {
+    FILE *file = fopen(frame_stats_file, "a");
+    if (!file) {
+        g_warning("Can't open %s for frame stats; no longer writing them",
+                frame_stats_file);
+        return G_SOURCE_REMOVE;
+    }
+
+    GPtrArray *overlay_values = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        JSCValue *value = js_frame_stats_new(overlay);
+        JSCValue *geometry = js_rectangle_new(&overlay->geometry);
+        jsc_value_object_set_property(value, "window", geometry);
+        g_object_unref(geometry);
+        g_ptr_array_add(overlay_values, value);
+    }
+    JSCValue *line = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_number(line, "time", g_get_real_time() / 1e6);
+    JSCValue *list = jsc_value_new_array_from_garray(native_js_context,
+            overlay_values);
+    g_ptr_array_unref(overlay_values);
+    jsc_value_object_set_property(line, "overlays", list);
+    g_object_unref(list);
+
+    char *json = jsc_value_to_json(line, 0);
+    fprintf(file, "%s\n", json);
+    g_free(json);
+    g_object_unref(line);
+    fclose(file);
+    return G_SOURCE_CONTINUE;
+}
+
+//
+// Data feed
+//
+
+// With --data-socket or --data-fifo, we read messages from other programs,
+// and hand them to pages as `data` events, so they don't need a web server
+// in between.  Everything is read asynchronously on the main loop, so a slow
+// or stuck writer can't hold up rendering.
+
+enum data_framing {
+    // Each message is a line of UTF-8 text, delivered as a string.
+    DATA_FRAMING_LINES,
+    // Each message is a 4-byte big-endian length, followed by that many
+    // bytes, delivered as an ArrayBuffer.
+    DATA_FRAMING_LENGTH,
+};
+enum data_framing data_framing = DATA_FRAMING_LINES;
+char *data_socket_path = NULL;
+char *data_fifo_path = NULL;
+
+// Longest message we accept.  A writer that sends a longer one is assumed to
+// be confused, and cut off.
+#define MAX_DATA_MESSAGE_SIZE (16 * 1024 * 1024)
+#define DATA_READ_SIZE (64 * 1024)
+
+// One stream we're reading messages from: a socket client, or the FIFO.
+struct data_reader {
+    GInputStream *stream;
+    // Whatever owns the stream, if it needs keeping alive.
+    GObject *owner;
+    // What's been read but not yet made into messages.
+    GByteArray *buffer;
+    char *description;
+};
+
+static void data_reader_free(struct data_reader *reader) {
+    g_input_stream_close(reader->stream, NULL, NULL);
+    g_object_unref(reader->stream);
+    if (reader->owner) g_object_unref(reader->owner);
+    g_byte_array_unref(reader->buffer);
+    g_free(reader->description);
+    g_free(reader);
+}
+
+static void emit_data_message(const guint8 *data, gsize size) {
+    JSCValue *value;
+    if (data_framing == DATA_FRAMING_LINES) {
+        char *string = g_strndup((const char *)data, size);
+        value = jsc_value_new_string(native_js_context, string);
+        g_free(string);
+    } else {
+        GBytes *bytes = g_bytes_new(data, size);
+        gsize length;
+        gconstpointer contents = g_bytes_get_data(bytes, &length);
+        // The ArrayBuffer uses the GBytes' memory directly, and releases it
+        // when it's collected.
+        value = jsc_value_new_array_buffer(native_js_context,
+                (gpointer)contents, length,
+                (GDestroyNotify)g_bytes_unref, bytes);
+    }
+    emit_event_to_all("data", NULL, value, EVENT_QUEUE);
+}
+
+// Emits every complete message in the reader's buffer, and removes them from
+// it.  Returns FALSE if the reader sent something that can't be a message.
+static bool extract_data_messages(struct data_reader *reader) {
+    GByteArray *buffer = reader->buffer;
+    // Nobody listening means nothing to do but discard it, so writers don't
+    // block on us.
+    bool wanted = anyone_is_subscribed("data");
+    gsize consumed = 0;
+
+    if (data_framing == DATA_FRAMING_LINES) {
+        while (consumed < buffer->len) {
+            guint8 *start = buffer->data + consumed;
+            guint8 *newline = memchr(start, '\n', buffer->len - consumed);
+            if (!newline) break;
+            if (wanted) emit_data_message(start, newline - start);
+            consumed += newline - start + 1;
+        }
+        if (buffer->len - consumed > MAX_DATA_MESSAGE_SIZE) return FALSE;
+    } else {
+        while (buffer->len - consumed >= 4) {
+            guint8 *header = buffer->data + consumed;
+            guint32 size = (guint32)header[0] << 24 | header[1] << 16
+                | header[2] << 8 | header[3];
+            if (size > MAX_DATA_MESSAGE_SIZE) return FALSE;
+            if (buffer->len - consumed - 4 < size) break;
+            if (wanted) emit_data_message(header + 4, size);
+            consumed += 4 + size;
+        }
+    }
+
+    g_byte_array_remove_range(buffer, 0, consumed);
+    return TRUE;
+}
+
+static void data_reader_read(struct data_reader *reader);
+
+static void on_data_read(GObject *object, GAsyncResult *result,
+        gpointer user_data) {
+    struct data_reader *reader = user_data;
+    GError *error = NULL;
+    GBytes *bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(object),
+            result, &error);
+    if (!bytes) {
+        g_warning("Error reading data from %s: %s",
+                reader->description, error->message);
+        g_error_free(error);
+        data_reader_free(reader);
+        return;
+    }
+
+    gsize size;
+    gconstpointer data = g_bytes_get_data(bytes, &size);
+    if (size == 0) {
+        // End of stream.  The client disconnected.
+        g_bytes_unref(bytes);
+        data_reader_free(reader);
+        return;
+    }
+    g_byte_array_append(reader->buffer, data, size);
+    g_bytes_unref(bytes);
+
+    if (!extract_data_messages(reader)) {
+        g_warning("Message from %s is over %d bytes; disconnecting it",
+                reader->description, MAX_DATA_MESSAGE_SIZE);
+        data_reader_free(reader);
+        return;
+    }
+    data_reader_read(reader);
+}
+
+static void data_reader_read(struct data_reader *reader) {
+    g_input_stream_read_bytes_async(reader->stream, DATA_READ_SIZE,
+            G_PRIORITY_DEFAULT, NULL, on_data_read, reader);
+}
+
+static void data_reader_start(GInputStream *stream, GObject *owner,
+        const char *description) {
+    struct data_reader *reader = g_new0(struct data_reader, 1);
+    reader->stream = g_object_ref(stream);
+    reader->owner = owner ? g_object_ref(owner) : NULL;
+    reader->buffer = g_byte_array_new();
+    reader->description = g_strdup(description);
+    data_reader_read(reader);
+}
+
+static gboolean on_data_socket_incoming(GSocketService *service,
+        GSocketConnection *connection, GObject *source_object,
+        gpointer user_data) {
+    data_reader_start(g_io_stream_get_input_stream(G_IO_STREAM(connection)),
+            G_OBJECT(connection), data_socket_path);
+    return TRUE;
+}
+
+static void remove_data_socket(void) {
+    unlink(data_socket_path);
+}
+
+// Starts listening on --data-socket.  Each connecting client is read from
+// separately, so messages from different clients don't get mixed up.
+void open_data_socket(void) {
+    // A socket file left over from a previous run that didn't exit cleanly
+    // would make binding fail, so remove it.  Only if it is a socket, in case
+    // the user gave us the path of something precious by mistake.
+    struct stat file_stat;
+    if (stat(data_socket_path, &file_stat) == 0 && S_ISSOCK(file_stat.st_mode))
+        unlink(data_socket_path);
+
+    GSocketService *service = g_socket_service_new();
+    GSocketAddress *address = g_unix_socket_address_new(data_socket_path);
+    GError *error = NULL;
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                NULL, NULL, &error)) {
+        fprintf(stderr, "Can't listen on --data-socket %s: %s\n",
+                data_socket_path, error->message);
+        exit(7);
+    }
+    g_object_unref(address);
+    atexit(remove_data_socket);
+    g_signal_connect(service, "incoming",
+            G_CALLBACK(on_data_socket_incoming), NULL);
+    g_socket_service_start(service);
+}
+
+// Starts reading --data-fifo, creating it if it doesn't exist.
+void open_data_fifo(void) {
+    struct stat file_stat;
+    if (stat(data_fifo_path, &file_stat) != 0) {
+        if (mkfifo(data_fifo_path, 0600) != 0) {
+            fprintf(stderr, "Can't create --data-fifo %s: %s\n",
+                    data_fifo_path, g_strerror(errno));
+            exit(7);
+        }
+    } else if (!S_ISFIFO(file_stat.st_mode)) {
+        fprintf(stderr, "--data-fifo %s exists, but isn't a FIFO\n",
+                data_fifo_path);
+        exit(7);
+    }
+
+    // Opened for writing too, though we never write to it.  Otherwise we'd
+    // get end-of-file every time the last writer closes it, and have to
+    // reopen it.  Non-blocking, so opening doesn't wait for a writer.
+    int fd = open(data_fifo_path, O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open --data-fifo %s: %s\n",
+                data_fifo_path, g_strerror(errno));
+        exit(7);
+    }
+    GInputStream *stream = g_unix_input_stream_new(fd, TRUE);
+    data_reader_start(stream, NULL, data_fifo_path);
+    g_object_unref(stream);
+}
+
+//
+// System metrics
+//
+
+// Pages listening for `metrics` events get CPU, memory, network, and
+// temperature readings every --metrics-interval milliseconds.  Reading /proc
+// and /sys can block (hwmon drivers especially), so it's done on a thread of
+// its own, which only runs while some page is listening.  Everything the
+// pages get is computed on that thread; the main thread only turns it into
+// JavaScript values.
+
+double metrics_interval_ms = 1000;
+#define MIN_METRICS_INTERVAL_MS 50
+
+struct network_reading {
+    char name[32];
+    guint64 rx_bytes;
+    guint64 tx_bytes;
+    // Since the previous sample.
+    double rx_bytes_per_s;
+    double tx_bytes_per_s;
+};
+
+struct temperature_reading {
+    // hwmon device name and sensor label, like "coretemp/Core 0".
+    char label[96];
+    double celsius;
+};
+
+// Busy and total time of a CPU (or all of them), in clock ticks since boot.
+struct cpu_times {
+    guint64 busy;
+    guint64 total;
+};
+
+struct metrics_sample {
+    // Busy percentage since the previous sample, of all CPUs together, and
+    // of each one.
+    double cpu_percent;
+    GArray *core_percents; // of double
+    guint64 memory_total_kb;
+    guint64 memory_available_kb;
+    GArray *network; // of struct network_reading
+    GArray *temperatures; // of struct temperature_reading
+};
+
+static void metrics_sample_free(struct metrics_sample *sample) {
+    g_array_unref(sample->core_percents);
+    g_array_unref(sample->network);
+    g_array_unref(sample->temperatures);
+    g_free(sample);
+}
+
+struct {
+    GThread *thread;
+    GMutex mutex;
+    GCond wake;
+    bool stop;
+} metrics_sampler;
+
+// Reads /proc/stat into an array of struct cpu_times: all CPUs together
+// first, then each one.
+static GArray *read_cpu_times(void) {
+    GArray *times = g_array_new(FALSE, TRUE, sizeof(struct cpu_times));
+    char *contents;
+    if (!g_file_get_contents("/proc/stat", &contents, NULL, NULL))
+        return times;
+    char **lines = g_strsplit(contents, "\n", -1);
+    for (char **line = lines; *line; ++line) {
+        if (strncmp(*line, "cpu", 3)) continue;
+        unsigned long long user, nice, system, idle, iowait, irq, softirq,
+                 steal;
+        if (sscanf(*line, "%*s %llu %llu %llu %llu %llu %llu %llu %llu",
+                    &user, &nice, &system, &idle, &iowait, &irq, &softirq,
+                    &steal) != 8)
+            continue;
+        struct cpu_times t;
+        t.total = user + nice + system + idle + iowait + irq + softirq + steal;
+        t.busy = t.total - idle - iowait;
+        g_array_append_val(times, t);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return times;
+}
+
+static double cpu_percent_between(struct cpu_times *before,
+        struct cpu_times *after) {
+    if (after->total <= before->total) return 0;
+    return 100.0 * (after->busy - before->busy)
+        / (after->total - before->total);
+}
+
+static void read_memory(struct metrics_sample *sample) {
+    char *contents;
+    if (!g_file_get_contents("/proc/meminfo", &contents, NULL, NULL)) return;
+    char **lines = g_strsplit(contents, "\n", -1);
+    for (char **line = lines; *line; ++line) {
+        unsigned long long kb;
+        if (sscanf(*line, "MemTotal: %llu", &kb) == 1)
+            sample->memory_total_kb = kb;
+        else if (sscanf(*line, "MemAvailable: %llu", &kb) == 1)
+            sample->memory_available_kb = kb;
+    }
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static void read_network(GArray *readings) {
+    char *contents;
+    if (!g_file_get_contents("/proc/net/dev", &contents, NULL, NULL)) return;
+    char **lines = g_strsplit(contents, "\n", -1);
+    // The header lines have no colons, so they get skipped.
+    for (char **line = lines; *line; ++line) {
+        char *colon = strchr(*line, ':');
+        if (!colon) continue;
+        *colon = '\0';
+        struct network_reading reading = { 0 };
+        g_strlcpy(reading.name, g_strstrip(*line), sizeof(reading.name));
+        unsigned long long rx, tx;
+        if (sscanf(colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu",
+                    &rx, &tx) != 2)
+            continue;
+        reading.rx_bytes = rx;
+        reading.tx_bytes = tx;
+        g_array_append_val(readings, reading);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static void read_temperatures(GArray *readings) {
+    GDir *hwmons = g_dir_open("/sys/class/hwmon", 0, NULL);
+    if (!hwmons) return;
+    const char *hwmon;
+    while ((hwmon = g_dir_read_name(hwmons))) {
+        char *dir_path = g_build_filename("/sys/class/hwmon", hwmon, NULL);
+        char *name_path = g_build_filename(dir_path, "name", NULL);
+        char *device_name = NULL;
+        if (g_file_get_contents(name_path, &device_name, NULL, NULL))
+            g_strstrip(device_name);
+        g_free(name_path);
+
+        // Sensors are numbered from 1, usually without gaps, but not always,
+        // so look through the whole directory.
+        GDir *files = g_dir_open(dir_path, 0, NULL);
+        const char *file;
+        while (files && (file = g_dir_read_name(files))) {
+            int index;
+            char suffix[8];
+            if (sscanf(file, "temp%d_%7s", &index, suffix) != 2 ||
+                    strcmp(suffix, "input"))
+                continue;
+            char *input_path = g_build_filename(dir_path, file, NULL);
+            char *input = NULL;
+            if (g_file_get_contents(input_path, &input, NULL, NULL)) {
+                char *label_file = g_strdup_printf("temp%d_label", index);
+                char *label_path = g_build_filename(dir_path, label_file,
+                        NULL);
+                char *label = NULL;
+                if (g_file_get_contents(label_path, &label, NULL, NULL))
+                    g_strstrip(label);
+
+                struct temperature_reading reading;
+                // hwmon gives millidegrees.
+                reading.celsius = g_ascii_strtod(input, NULL) / 1000;
+                // Unlabelled sensors are called what their files are.
+                if (label)
+                    snprintf(reading.label, sizeof(reading.label), "%s/%s",
+                            device_name ? device_name : hwmon, label);
+                else
+                    snprintf(reading.label, sizeof(reading.label),
+                            "%s/temp%d", device_name ? device_name : hwmon,
+                            index);
+                g_array_append_val(readings, reading);
+
+                g_free(label);
+                g_free(label_path);
+                g_free(label_file);
+                g_free(input);
+            }
+            g_free(input_path);
+        }
+        if (files) g_dir_close(files);
+        g_free(device_name);
+        g_free(dir_path);
+    }
+    g_dir_close(hwmons);
+}
+
+static gboolean on_metrics_sample(gpointer user_data) {
+    struct metrics_sample *sample = user_data;
+    JSCValue *value = jsc_value_new_object(native_js_context, NULL, NULL);
+
+    js_set_number(value, "cpu", sample->cpu_percent);
+    GPtrArray *list = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < sample->core_percents->len; ++i)
+        g_ptr_array_add(list, jsc_value_new_number(native_js_context,
+                    g_array_index(sample->core_percents, double, i)));
+    JSCValue *cores = jsc_value_new_array_from_garray(native_js_context, list);
+    g_ptr_array_unref(list);
+    jsc_value_object_set_property(value, "cores", cores);
+    g_object_unref(cores);
+
+    JSCValue *memory = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_number(memory, "totalKb", sample->memory_total_kb);
+    js_set_number(memory, "availableKb", sample->memory_available_kb);
+    jsc_value_object_set_property(value, "memory", memory);
+    g_object_unref(memory);
+
+    JSCValue *network = jsc_value_new_object(native_js_context, NULL, NULL);
+    for (int i = 0; i < sample->network->len; ++i) {
+        struct network_reading *reading =
+            &g_array_index(sample->network, struct network_reading, i);
+        JSCValue *rates = jsc_value_new_object(native_js_context, NULL, NULL);
+        js_set_number(rates, "rxBytesPerS", reading->rx_bytes_per_s);
+        js_set_number(rates, "txBytesPerS", reading->tx_bytes_per_s);
+        jsc_value_object_set_property(network, reading->name, rates);
+        g_object_unref(rates);
+    }
+    jsc_value_object_set_property(value, "network", network);
+    g_object_unref(network);
+
+    JSCValue *temperatures = jsc_value_new_object(native_js_context,
+            NULL, NULL);
+    for (int i = 0; i < sample->temperatures->len; ++i) {
+        struct temperature_reading *reading =
+            &g_array_index(sample->temperatures,
+                    struct temperature_reading, i);
+        js_set_number(temperatures, reading->label, reading->celsius);
+    }
+    jsc_value_object_set_property(value, "temperatures", temperatures);
+    g_object_unref(temperatures);
+
+    metrics_sample_free(sample);
+    // Only the newest reading matters to anyone.
+    emit_event_to_all("metrics", NULL, value, EVENT_LATEST);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer run_metrics_sampler(gpointer data) {
+    GArray *last_cpu_times = NULL;
+    GArray *last_network = NULL;
+    gint64 last_time = 0;
+
+    g_mutex_lock(&metrics_sampler.mutex);
+    while (!metrics_sampler.stop) {
+        g_mutex_unlock(&metrics_sampler.mutex);
+
+        gint64 now = g_get_monotonic_time();
+        GArray *cpu_times = read_cpu_times();
+        GArray *network = g_array_new(FALSE, TRUE,
+                sizeof(struct network_reading));
+        read_network(network);
+
+        // Rates need a previous sample to compare against, so the first
+        // round only takes one.
+        if (last_time) {
+            struct metrics_sample *sample = g_new0(struct metrics_sample, 1);
+            sample->core_percents = g_array_new(FALSE, TRUE, sizeof(double));
+            int n_cpus = MIN(cpu_times->len, last_cpu_times->len);
+            for (int i = 0; i < n_cpus; ++i) {
+                double percent = cpu_percent_between(
+                        &g_array_index(last_cpu_times, struct cpu_times, i),
+                        &g_array_index(cpu_times, struct cpu_times, i));
+                if (i == 0) sample->cpu_percent = percent;
+                else g_array_append_val(sample->core_percents, percent);
+            }
+
+            double seconds = (now - last_time) / 1e6;
+            for (int i = 0; i < network->len; ++i) {
+                struct network_reading *reading =
+                    &g_array_index(network, struct network_reading, i);
+                for (int j = 0; j < last_network->len; ++j) {
+                    struct network_reading *last =
+                        &g_array_index(last_network, struct network_reading, j);
+                    if (strcmp(reading->name, last->name)) continue;
+                    // Counters reset if an interface is recreated.
+                    if (reading->rx_bytes >= last->rx_bytes)
+                        reading->rx_bytes_per_s =
+                            (reading->rx_bytes - last->rx_bytes) / seconds;
+                    if (reading->tx_bytes >= last->tx_bytes)
+                        reading->tx_bytes_per_s =
+                            (reading->tx_bytes - last->tx_bytes) / seconds;
+                    break;
+                }
+            }
+            sample->network = g_array_ref(network);
+
+            read_memory(sample);
+            sample->temperatures = g_array_new(FALSE, TRUE,
+                    sizeof(struct temperature_reading));
+            read_temperatures(sample->temperatures);
+
+            g_idle_add(on_metrics_sample, sample);
+        }
+
+        if (last_cpu_times) g_array_unref(last_cpu_times);
+        if (last_network) g_array_unref(last_network);
+        last_cpu_times = cpu_times;
+        last_network = network;
+        last_time = now;
+
+        g_mutex_lock(&metrics_sampler.mutex);
+        gint64 wake_at = g_get_monotonic_time() + metrics_interval_ms * 1000;
+        while (!metrics_sampler.stop &&
+                g_cond_wait_until(&metrics_sampler.wake,
+                    &metrics_sampler.mutex, wake_at))
+            ; // Woken early, but not told to stop, so keep waiting.
+    }
+    g_mutex_unlock(&metrics_sampler.mutex);
+
+    if (last_cpu_times) g_array_unref(last_cpu_times);
+    if (last_network) g_array_unref(last_network);
+    return NULL;
+}
+
+// Starts the sampler thread if some page is listening for metrics, and stops
+// it if none are.  Call whenever subscriptions might have changed.
+void update_metrics_sampler(void) {
+    bool wanted = anyone_is_subscribed("metrics");
+    if (wanted && !metrics_sampler.thread) {
+        metrics_sampler.stop = FALSE;
+        metrics_sampler.thread = g_thread_new("metrics sampler",
+                run_metrics_sampler, NULL);
+    } else if (!wanted && metrics_sampler.thread) {
+        g_mutex_lock(&metrics_sampler.mutex);
+        metrics_sampler.stop = TRUE;
+        g_cond_signal(&metrics_sampler.wake);
+        g_mutex_unlock(&metrics_sampler.mutex);
+        g_thread_join(metrics_sampler.thread);
+        metrics_sampler.thread = NULL;
+    }
+}
+
+//
+// hudkit:// bundles
+//
+
+// A bundle is a directory's files packed into one file, which we mmap and
+// serve pages from under the hudkit:// scheme, with no web server, and
+// without reading lots of small files.  Responses point straight into the
+// mapped file, so nothing is copied on our side.
+//
+// Layout, all integers little-endian:
+//
+//     struct bundle_header
+//     struct bundle_entry[n_entries], sorted by path
+//     the paths and content types, not NUL-terminated
+//     the files' contents
+//
+// Build one with --make-bundle.
+
+#define BUNDLE_MAGIC "HUDKITB1"
+
+struct bundle_header {
+    char magic[8];
+    guint32 n_entries;
+    guint32 reserved;
+};
+
+struct bundle_entry {
+    guint64 data_offset;
+    guint64 data_size;
+    guint32 path_offset;
+    guint32 path_length;
+    guint32 type_offset;
+    guint32 type_length;
+};
+
+G_STATIC_ASSERT(sizeof(struct bundle_header) == 16);
+G_STATIC_ASSERT(sizeof(struct bundle_entry) == 32);
+
+// From --bundle.
+char *bundle_path = NULL;
+GMappedFile *bundle_file;
+GBytes *bundle_bytes;
+const struct bundle_entry *bundle_entries;
+guint32 bundle_n_entries;
+
+// From --bundle-header, as "Name: value" strings.
+GPtrArray *bundle_headers;
+
+// Content types that matter to how browsers treat a file, which content type
+// guessing from the system's MIME database might get wrong (module scripts
+// won't run unless served as JavaScript, for example).
+static const char *web_content_types[][2] = {
+    { ".html", "text/html" },
+    { ".htm",  "text/html" },
+    { ".js",   "text/javascript" },
+    { ".mjs",  "text/javascript" },
+    { ".css",  "text/css" },
+    { ".json", "application/json" },
+    { ".wasm", "application/wasm" },
+    { ".svg",  "image/svg+xml" },
+};
+
+static char *guess_content_type(const char *path, const guchar *data,
+        gsize size) {
+    for (int i = 0; i < G_N_ELEMENTS(web_content_types); ++i)
+        if (g_str_has_suffix(path, web_content_types[i][0]))
+            return g_strdup(web_content_types[i][1]);
+    char *type = g_content_type_guess(path, data, size, NULL);
+    char *mime_type = g_content_type_get_mime_type(type);
+    g_free(type);
+    return mime_type ? mime_type : g_strdup("application/octet-stream");
+}
+
+struct bundle_source {
+    char *path;      // relative to the bundled directory, '/'-separated
+    char *full_path;
+};
+
+static void collect_bundle_sources(const char *dir, const char *prefix,
+        GArray *sources) {
+    GError *error = NULL;
+    GDir *handle = g_dir_open(dir, 0, &error);
+    if (!handle) {
+        fprintf(stderr, "Can't read %s: %s\n", dir, error->message);
+        exit(8);
+    }
+    const char *name;
+    while ((name = g_dir_read_name(handle))) {
+        char *full_path = g_build_filename(dir, name, NULL);
+        char *path = *prefix ? g_strconcat(prefix, "/", name, NULL)
+                             : g_strdup(name);
+        if (g_file_test(full_path, G_FILE_TEST_IS_DIR)) {
+            collect_bundle_sources(full_path, path, sources);
+            g_free(full_path);
+            g_free(path);
+        } else {
+            struct bundle_source source = { path, full_path };
+            g_array_append_val(sources, source);
+        }
+    }
+    g_dir_close(handle);
+}
+
+static int compare_bundle_sources(gconstpointer a, gconstpointer b) {
+    return strcmp(((struct bundle_source *)a)->path,
+            ((struct bundle_source *)b)->path);
+}
+
+// Packs every file under `dir` into a bundle at `out`, for --make-bundle.
+// Exits when done.
+void make_bundle(const char *dir, const char *out) {
+    GArray *sources = g_array_new(FALSE, TRUE, sizeof(struct bundle_source));
+    collect_bundle_sources(dir, "", sources);
+    g_array_sort(sources, compare_bundle_sources);
+    guint32 n = sources->len;
+
+    GString *strings = g_string_new(NULL);
+    struct bundle_entry *entries = g_new0(struct bundle_entry, n);
+    GBytes **contents = g_new0(GBytes *, n);
+    guint64 strings_start = sizeof(struct bundle_header)
+        + (guint64)n * sizeof(struct bundle_entry);
+
+    for (int i = 0; i < n; ++i) {
+        struct bundle_source *source =
+            &g_array_index(sources, struct bundle_source, i);
+        char *data;
+        gsize size;
+        GError *error = NULL;
+        if (!g_file_get_contents(source->full_path, &data, &size, &error)) {
+            fprintf(stderr, "Can't read %s: %s\n",
+                    source->full_path, error->message);
+            exit(8);
+        }
+        contents[i] = g_bytes_new_take(data, size);
+
+        char *type = guess_content_type(source->path, (guchar *)data, size);
+        entries[i].path_offset = GUINT32_TO_LE(strings_start + strings->len);
+        entries[i].path_length = GUINT32_TO_LE(strlen(source->path));
+        g_string_append(strings, source->path);
+        entries[i].type_offset = GUINT32_TO_LE(strings_start + strings->len);
+        entries[i].type_length = GUINT32_TO_LE(strlen(type));
+        g_string_append(strings, type);
+        entries[i].data_size = GUINT64_TO_LE(size);
+        g_free(type);
+    }
+
+    guint64 data_offset = strings_start + strings->len;
+    for (int i = 0; i < n; ++i) {
+        entries[i].data_offset = GUINT64_TO_LE(data_offset);
+        data_offset += g_bytes_get_size(contents[i]);
+    }
+
+    FILE *file = fopen(out, "wb");
+    if (!file) {
+        fprintf(stderr, "Can't write %s: %s\n", out, g_strerror(errno));
+        exit(8);
+    }
+    struct bundle_header header = { .n_entries = GUINT32_TO_LE(n) };
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entries, sizeof(struct bundle_entry), n, file);
+    fwrite(strings->str, 1, strings->len, file);
+    for (int i = 0; i < n; ++i) {
+        gsize size;
+        gconstpointer data = g_bytes_get_data(contents[i], &size);
+        fwrite(data, 1, size, file);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Can't write %s: %s\n", out, g_strerror(errno));
+        exit(8);
+    }
+    printf("Bundled %u files from %s into %s\n", n, dir, out);
+    exit(0);
+}
+
+static bool bundle_range_ok(guint64 offset, guint64 length, gsize size) {
+    return offset <= size && length <= size - offset;
+}
+
+// Maps --bundle and checks that it's intact, so lookups can trust it.
+// Exits if it isn't.
+void open_bundle(void) {
+    GError *error = NULL;
+    bundle_file = g_mapped_file_new(bundle_path, FALSE, &error);
+    if (!bundle_file) {
+        fprintf(stderr, "Can't open --bundle %s: %s\n",
+                bundle_path, error->message);
+        exit(8);
+    }
+    bundle_bytes = g_mapped_file_get_bytes(bundle_file);
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bundle_bytes, &size);
+
+    const struct bundle_header *header = (const void *)data;
+    if (size < sizeof(*header) ||
+            memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic))) {
+        fprintf(stderr, "--bundle %s isn't a hudkit bundle\n", bundle_path);
+        exit(8);
+    }
+    bundle_n_entries = GUINT32_FROM_LE(header->n_entries);
+    bundle_entries = (const void *)(data + sizeof(*header));
+    bool ok = bundle_range_ok(sizeof(*header),
+            (guint64)bundle_n_entries * sizeof(struct bundle_entry), size);
+    for (guint32 i = 0; ok && i < bundle_n_entries; ++i) {
+        const struct bundle_entry *e = &bundle_entries[i];
+        ok = bundle_range_ok(GUINT32_FROM_LE(e->path_offset),
+                    GUINT32_FROM_LE(e->path_length), size)
+            && bundle_range_ok(GUINT32_FROM_LE(e->type_offset),
+                    GUINT32_FROM_LE(e->type_length), size)
+            && bundle_range_ok(GUINT64_FROM_LE(e->data_offset),
+                    GUINT64_FROM_LE(e->data_size), size);
+    }
+    if (!ok) {
+        fprintf(stderr, "--bundle %s is truncated or corrupt\n", bundle_path);
+        exit(8);
+    }
+}
+
+static int compare_bundle_path(const char *path, gsize length,
+        const struct bundle_entry *entry) {
+    const char *data = g_bytes_get_data(bundle_bytes, NULL);
+    const char *entry_path = data + GUINT32_FROM_LE(entry->path_offset);
+    gsize entry_length = GUINT32_FROM_LE(entry->path_length);
+    int result = memcmp(path, entry_path, MIN(length, entry_length));
+    if (result) return result;
+    return length < entry_length ? -1 : length > entry_length;
+}
+
+static const struct bundle_entry *find_bundle_entry(const char *path) {
+    gsize length = strlen(path);
+    guint32 low = 0, high = bundle_n_entries;
+    while (low < high) {
+        guint32 middle = low + (high - low) / 2;
+        int result = compare_bundle_path(path, length,
+                &bundle_entries[middle]);
+        if (result == 0) return &bundle_entries[middle];
+        if (result < 0) high = middle;
+        else low = middle + 1;
+    }
+    return NULL;
+}
+
+static void on_hudkit_scheme_request(WebKitURISchemeRequest *request,
+        gpointer user_data) {
+    // The host part doesn't matter; hudkit://anything/a/b.js is a/b.js.
+    const char *request_path = webkit_uri_scheme_request_get_path(request);
+    while (*request_path == '/') ++request_path;
+    char *path = g_uri_unescape_string(request_path, NULL);
+    // Directories mean their index.html, like on most web servers.
+    if (path && (*path == '\0' || g_str_has_suffix(path, "/"))) {
+        char *index_path = g_strconcat(path, "index.html", NULL);
+        g_free(path);
+        path = index_path;
+    }
+
+    const struct bundle_entry *entry = path ? find_bundle_entry(path) : NULL;
+    if (!entry) {
+        GError *error = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                "%s is not in the bundle", path ? path : request_path);
+        webkit_uri_scheme_request_finish_error(request, error);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    // Both of these refer into the mapped file, rather than copying.
+    GBytes *contents = g_bytes_new_from_bytes(bundle_bytes,
+            GUINT64_FROM_LE(entry->data_offset),
+            GUINT64_FROM_LE(entry->data_size));
+    GInputStream *stream = g_memory_input_stream_new_from_bytes(contents);
+    WebKitURISchemeResponse *response = webkit_uri_scheme_response_new(
+            stream, g_bytes_get_size(contents));
+
+    const char *data = g_bytes_get_data(bundle_bytes, NULL);
+    char *type = g_strndup(data + GUINT32_FROM_LE(entry->type_offset),
+            GUINT32_FROM_LE(entry->type_length));
+    webkit_uri_scheme_response_set_content_type(response, type);
+    g_free(type);
+
+    if (bundle_headers->len > 0) {
+        SoupMessageHeaders *headers =
+            soup_message_headers_new(SOUP_MESSAGE_HEADERS_RESPONSE);
+        for (int i = 0; i < bundle_headers->len; ++i) {
+            const char *header = g_ptr_array_index(bundle_headers, i);
+            const char *colon = strchr(header, ':');
+            char *name = g_strndup(header, colon - header);
+            soup_message_headers_append(headers, g_strstrip(name),
+                    colon + 1 + strspn(colon + 1, " "));
+            g_free(name);
+        }
+        // The response takes ownership of the headers.
+        webkit_uri_scheme_response_set_http_headers(response, headers);
+    }
+
+    webkit_uri_scheme_request_finish_with_response(request, response);
+    g_object_unref(response);
+    g_object_unref(stream);
+    g_bytes_unref(contents);
+}
+
+// Serves --bundle under hudkit:// for every page loaded in `context`.
+void register_hudkit_scheme(WebKitWebContext *context) {
+    webkit_web_context_register_uri_scheme(context, "hudkit",
+            on_hudkit_scheme_request, NULL, NULL);
+    // Treat it like https, so pages get secure-context-only APIs, and can be
+    // cross-origin isolated with COOP/COEP headers.
+    WebKitSecurityManager *security =
+        webkit_web_context_get_security_manager(context);
+    webkit_security_manager_register_uri_scheme_as_secure(security, "hudkit");
+    webkit_security_manager_register_uri_scheme_as_cors_enabled(security,
+            "hudkit");
+}
+
+// The current monitor layout.  It's only re-read from GDK when monitors
+// actually change, rather than every time a page asks for it.
+struct {
+    GArray *monitors; // of struct monitor_info
+    // The layout as a JavaScript Array, ready to send to pages.
+    JSCValue *value;
+} monitor_layout;
+
+static void monitor_info_clear(gpointer data) {
+    struct monitor_info *monitor = data;
+    g_free(monitor->name);
+}
+
+// Whether two monitors with the same name look the same to pages.
+static bool monitor_info_equal(struct monitor_info *a,
+        struct monitor_info *b) {
+    return gdk_rectangle_equal(&a->geometry, &b->geometry)
+        && a->scale == b->scale && a->refresh_rate == b->refresh_rate
+        && a->width_mm == b->width_mm && a->height_mm == b->height_mm;
+}
+
+static JSCValue *js_monitor_new(struct monitor_info *monitor) {
+    JSCValue *object = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_string(object, "name", monitor->name);
+    js_set_number(object, "x", monitor->geometry.x);
+    js_set_number(object, "y", monitor->geometry.y);
+    js_set_number(object, "width", monitor->geometry.width);
+    js_set_number(object, "height", monitor->geometry.height);
+    js_set_number(object, "scale", monitor->scale);
+    js_set_number(object, "refreshRate", monitor->refresh_rate);
+    js_set_number(object, "widthMm", monitor->width_mm);
+    js_set_number(object, "heightMm", monitor->height_mm);
+    return object;
+}
+
+// Re-reads the monitor layout from GDK, and returns TRUE if it's different
+// from before.
+//
+// If it is, and `diff` isn't NULL, `*diff` is set to an object `{added,
+// removed, changed}`, each an Array of the monitors concerned, in the same
+// format as the layout.  Monitors are told apart by name, so a monitor that
+// was moved or resized counts as changed.  The caller unrefs it.
+bool update_monitor_layout(GdkDisplay *display, JSCValue **diff) {
+    GArray *old_monitors = monitor_layout.monitors;
+
+    int n = headless_monitors
+        ? headless_monitors->len : gdk_display_get_n_monitors(display);
+    GArray *new_monitors = g_array_sized_new(FALSE, TRUE,
+            sizeof(struct monitor_info), n);
+    g_array_set_clear_func(new_monitors, monitor_info_clear);
+    g_array_set_size(new_monitors, n);
+    for (int i = 0; i < n; ++i) {
+        struct monitor_info *info =
+            &g_array_index(new_monitors, struct monitor_info, i);
+        if (headless_monitors) {
+            struct monitor_info *virtual =
+                &g_array_index(headless_monitors, struct monitor_info, i);
+            *info = *virtual;
+            info->name = g_strdup(virtual->name);
+            continue;
+        }
+        GdkMonitor *monitor = gdk_display_get_monitor(display, i);
+        const char *model = gdk_monitor_get_model(monitor);
+        info->name = g_strdup(model ? model : "");
+        gdk_monitor_get_geometry(monitor, &info->geometry);
+        info->scale = gdk_monitor_get_scale_factor(monitor);
+        // GDK's is in millihertz.
+        info->refresh_rate = gdk_monitor_get_refresh_rate(monitor) / 1000.0;
+        info->width_mm = gdk_monitor_get_width_mm(monitor);
+        info->height_mm = gdk_monitor_get_height_mm(monitor);
+    }
+
+    // Pair up each new monitor with an old one: first ones that are exactly
+    // the same, then ones that merely have the same name.  Whatever's left
+    // over was added or removed.
+    int n_old = old_monitors ? old_monitors->len : 0;
+    int old_match_of_new[n + 1];
+    bool old_is_matched[n_old + 1];
+    for (int i = 0; i < n; ++i) old_match_of_new[i] = -1;
+    for (int j = 0; j < n_old; ++j) old_is_matched[j] = FALSE;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            if (old_match_of_new[i] != -1) continue;
+            struct monitor_info *new_monitor =
+                &g_array_index(new_monitors, struct monitor_info, i);
+            for (int j = 0; j < n_old; ++j) {
+                if (old_is_matched[j]) continue;
+                struct monitor_info *old_monitor =
+                    &g_array_index(old_monitors, struct monitor_info, j);
+                if (strcmp(new_monitor->name, old_monitor->name)) continue;
+                if (pass == 0 && !monitor_info_equal(new_monitor, old_monitor))
+                    continue;
+                old_match_of_new[i] = j;
+                old_is_matched[j] = TRUE;
+                break;
+            }
+        }
+    }
+
+    GPtrArray *added = g_ptr_array_new_with_free_func(g_object_unref);
+    GPtrArray *removed = g_ptr_array_new_with_free_func(g_object_unref);
+    GPtrArray *changed = g_ptr_array_new_with_free_func(g_object_unref);
+    bool anything_changed = FALSE;
+    for (int i = 0; i < n; ++i) {
+        struct monitor_info *new_monitor =
+            &g_array_index(new_monitors, struct monitor_info, i);
+        int j = old_match_of_new[i];
+        if (j == -1) {
+            g_ptr_array_add(added, js_monitor_new(new_monitor));
+            anything_changed = TRUE;
+        } else if (!monitor_info_equal(new_monitor,
+                    &g_array_index(old_monitors, struct monitor_info, j))) {
+            g_ptr_array_add(changed, js_monitor_new(new_monitor));
+            anything_changed = TRUE;
+        }
+    }
+    for (int j = 0; j < n_old; ++j) {
+        if (old_is_matched[j]) continue;
+        g_ptr_array_add(removed, js_monitor_new(
+                    &g_array_index(old_monitors, struct monitor_info, j)));
+        anything_changed = TRUE;
+    }
+    // Monitors can also be reordered without any of them changing.  Pages
+    // don't get told about that, but the cached layout still needs updating.
+    bool order_changed = n != n_old;
+    for (int i = 0; i < n && !order_changed; ++i)
+        if (old_match_of_new[i] != i) order_changed = TRUE;
+
+    if (diff && anything_changed) {
+        *diff = jsc_value_new_object(native_js_context, NULL, NULL);
+        const char *names[] = { "added", "removed", "changed" };
+        GPtrArray *lists[] = { added, removed, changed };
+        for (int i = 0; i < 3; ++i) {
+            JSCValue *list = jsc_value_new_array_from_garray(
+                    native_js_context, lists[i]);
+            jsc_value_object_set_property(*diff, names[i], list);
+            g_object_unref(list);
+        }
+    }
+    g_ptr_array_unref(added);
+    g_ptr_array_unref(removed);
+    g_ptr_array_unref(changed);
+
+    if (!anything_changed && !order_changed && old_monitors) {
+        g_array_free(new_monitors, TRUE);
+        return FALSE;
+    }
+
+    GPtrArray *layout_values = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; i < n; ++i)
+        g_ptr_array_add(layout_values, js_monitor_new(
+                    &g_array_index(new_monitors, struct monitor_info, i)));
+
+    if (old_monitors) g_array_free(old_monitors, TRUE);
+    if (monitor_layout.value) g_object_unref(monitor_layout.value);
+    monitor_layout.monitors = new_monitors;
+    monitor_layout.value = jsc_value_new_array_from_garray(native_js_context,
+            layout_values);
+    g_ptr_array_unref(layout_values);
+    return anything_changed;
+}
+
+//
+// Visibility
+//
+
+// While nobody can see an overlay, there's no point in it rendering.  That's
+// the case while the display is blanked (DPMS has turned the monitors off,
+// or the screensaver is on), or while fullscreen windows stacked above the
+// overlay cover every monitor it's on.  Then we unmap the overlay window,
+// which WebKit sees as its pages becoming hidden: requestAnimationFrame
+// callbacks stop, timers are throttled, and the pages get a
+// `visibilitychange`, as well as our 'visibility' event.
+//
+// This uses its own X connection, so the events we select on the root window
+// and on other clients' windows don't get mixed up with GDK's.  Other
+// clients' windows can go away while we're looking at them, but GDK's X
+// error handler ignores errors on connections it didn't open, so that's
+// harmless.  NULL if there's no X display, or it couldn't be opened.
+Display *visibility_xdisplay = NULL;
+bool has_screensaver_extension = FALSE;
+int screensaver_event_base;
+
+bool screensaver_on = FALSE;
+bool dpms_off = FALSE;
+
+// DPMS has no events we can rely on being there, so it's polled.
+#define DPMS_POLL_INTERVAL_MS 2000
+// Window managers restack and re-property windows in bursts, and only the
+// final state matters.
+#define VISIBILITY_DEBOUNCE_MS 100
+guint visibility_debounce_id = 0;
+
+Atom atom_net_client_list_stacking;
+Atom atom_net_wm_state;
+Atom atom_net_wm_state_fullscreen;
+Atom atom_net_wm_state_hidden;
+
+// A fullscreen window, and where it is in the stacking order of the root
+// window's children.
+struct fullscreen_window {
+    cairo_rectangle_int_t rect;
+    int stack_index;
+};
+
+// Returns the position of the child of the root window that `window` is, or
+// is inside, among the root window's `n_children` children, bottom first.
+// -1 if it isn't found.
+static int stack_index_of(Window window, Window *children,
+        unsigned int n_children) {
+    Display *dpy = visibility_xdisplay;
+    Window root = DefaultRootWindow(dpy);
+    // Reparenting window managers put clients inside frames, so walk up to
+    // whatever is directly in the root window.
+    for (;;) {
+        Window window_root, parent, *window_children;
+        unsigned int n;
+        if (!XQueryTree(dpy, window, &window_root, &parent,
+                    &window_children, &n))
+            return -1;
+        if (window_children) XFree(window_children);
+        if (parent == root || parent == None) break;
+        window = parent;
+    }
+    for (int i = 0; i < n_children; ++i)
+        if (children[i] == window) return i;
+    return -1;
+}
+
+static bool window_is_fullscreen(Window window) {
+    Atom type;
+    int format;
+    unsigned long n_atoms, bytes_after;
+    unsigned char *data = NULL;
+    if (XGetWindowProperty(visibility_xdisplay, window, atom_net_wm_state,
+                0, 64, False, XA_ATOM, &type, &format, &n_atoms,
+                &bytes_after, &data) != Success || !data)
+        return FALSE;
+    bool fullscreen = FALSE, hidden = FALSE;
+    Atom *atoms = (Atom *)data;
+    for (unsigned long i = 0; i < n_atoms; ++i) {
+        if (atoms[i] == atom_net_wm_state_fullscreen) fullscreen = TRUE;
+        if (atoms[i] == atom_net_wm_state_hidden) hidden = TRUE;
+    }
+    XFree(data);
+    return fullscreen && !hidden;
+}
+
+// Finds every visible fullscreen window the window manager knows of, and
+// starts listening for changes to them.
+static GArray *find_fullscreen_windows(Window *children,
+        unsigned int n_children) {
+    Display *dpy = visibility_xdisplay;
+    Window root = DefaultRootWindow(dpy);
+    GArray *found = g_array_new(FALSE, FALSE,
+            sizeof(struct fullscreen_window));
+
+    Atom type;
+    int format;
+    unsigned long n_clients, bytes_after;
+    unsigned char *data = NULL;
+    if (XGetWindowProperty(dpy, root, atom_net_client_list_stacking,
+                0, 4096, False, XA_WINDOW, &type, &format, &n_clients,
+                &bytes_after, &data) != Success || !data)
+        return found;
+
+    Window *clients = (Window *)data;
+    for (unsigned long i = 0; i < n_clients; ++i) {
+        // So we hear when it goes fullscreen, or stops being.  Doing this
+        // every time is cheap, and picks up new clients.
+        XSelectInput(dpy, clients[i], PropertyChangeMask);
+
+        if (!window_is_fullscreen(clients[i])) continue;
+        XWindowAttributes attributes;
+        if (!XGetWindowAttributes(dpy, clients[i], &attributes) ||
+                attributes.map_state != IsViewable)
+            continue;
+        int x, y;
+        Window child;
+        if (!XTranslateCoordinates(dpy, clients[i], root, 0, 0, &x, &y,
+                    &child))
+            continue;
+        struct fullscreen_window window = {
+            .rect = { x, y, attributes.width, attributes.height },
+            .stack_index = stack_index_of(clients[i], children, n_children),
+        };
+        g_array_append_val(found, window);
+    }
+    XFree(data);
+    return found;
+}
+
+// Whether the monitors the overlay is on are entirely covered by fullscreen
+// windows stacked above it.
+static bool overlay_is_covered(struct overlay *overlay, GArray *fullscreen,
+        Window *children, unsigned int n_children) {
+    if (fullscreen->len == 0) return FALSE;
+    GdkWindow *gdk_window = gtk_widget_get_window(overlay->window);
+    if (!gdk_window) return FALSE;
+    int own_index = stack_index_of(gdk_x11_window_get_xid(gdk_window),
+            children, n_children);
+
+    // What the overlay shows is its monitors, not its whole bounding box.
+    cairo_region_t *visible = cairo_region_create();
+    GArray *monitors = monitor_layout.monitors;
+    for (int i = 0; i < monitors->len; ++i) {
+        cairo_rectangle_int_t rect =
+            g_array_index(monitors, struct monitor_info, i).geometry;
+        cairo_region_union_rectangle(visible, &rect);
+    }
+    cairo_region_intersect_rectangle(visible, &overlay->geometry);
+
+    for (int i = 0; i < fullscreen->len; ++i) {
+        struct fullscreen_window *window =
+            &g_array_index(fullscreen, struct fullscreen_window, i);
+        if (window->stack_index > own_index)
+            cairo_region_subtract_rectangle(visible, &window->rect);
+    }
+    bool covered = cairo_region_is_empty(visible);
+    cairo_region_destroy(visible);
+    return covered;
+}
+
+static JSCValue *js_visibility_new(struct overlay *overlay) {
+    JSCValue *object = jsc_value_new_object(native_js_context, NULL, NULL);
+    JSCValue *visible = jsc_value_new_boolean(native_js_context,
+            overlay->hidden_reason == NULL);
+    jsc_value_object_set_property(object, "visible", visible);
+    g_object_unref(visible);
+    if (overlay->hidden_reason) {
+        js_set_string(object, "reason", overlay->hidden_reason);
+    } else {
+        JSCValue *null = jsc_value_new_null(native_js_context);
+        jsc_value_object_set_property(object, "reason", null);
+        g_object_unref(null);
+    }
+    return object;
+}
+
+void emit_visibility(struct layer *layer) {
+    emit_event(layer, "visibility", NULL, js_visibility_new(layer->overlay),
+            EVENT_LATEST);
+}
+
+// Hides or shows the overlay.  `reason` is why it's hidden ("dpms",
+// "screensaver", or "fullscreen"), or NULL to show it.
+static void set_overlay_hidden(struct overlay *overlay, const char *reason) {
+    if (g_strcmp0(reason, overlay->hidden_reason) == 0) return;
+    overlay->hidden_reason = reason;
+    // Pages are told first, so they can stop their own work before they're
+    // throttled.
+    emit_event_to_layers(overlay, "visibility", NULL,
+            js_visibility_new(overlay), EVENT_LATEST);
+    if (reason) gtk_widget_hide(overlay->window);
+    else gtk_widget_show(overlay->window);
+}
+
+static void process_visibility_x_events(void);
+
+static void update_visibility(void) {
+    Display *dpy = visibility_xdisplay;
+    Window root_return, parent, *children = NULL;
+    unsigned int n_children = 0;
+    XQueryTree(dpy, DefaultRootWindow(dpy), &root_return, &parent,
+            &children, &n_children);
+    GArray *fullscreen = find_fullscreen_windows(children, n_children);
+
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        const char *reason =
+            dpms_off ? "dpms" :
+            screensaver_on ? "screensaver" :
+            overlay_is_covered(overlay, fullscreen, children, n_children)
+                ? "fullscreen" :
+            NULL;
+        set_overlay_hidden(overlay, reason);
+    }
+
+    g_array_free(fullscreen, TRUE);
+    if (children) XFree(children);
+    // Anything that arrived while we were asking the X server things has
+    // been read off the connection already, so the fd won't tell us about it.
+    process_visibility_x_events();
+}
+
+static gboolean on_visibility_settled(gpointer user_data) {
+    visibility_debounce_id = 0;
+    update_visibility();
+    return G_SOURCE_REMOVE;
+}
+
+void schedule_visibility_update(void) {
+    if (!visibility_xdisplay) return;
+    if (visibility_debounce_id) g_source_remove(visibility_debounce_id);
+    visibility_debounce_id = g_timeout_add(VISIBILITY_DEBOUNCE_MS,
+            on_visibility_settled, NULL);
+}
+
+static void process_visibility_x_events(void) {
+    Display *dpy = visibility_xdisplay;
+    while (XPending(dpy)) {
+        XEvent event;
+        XNextEvent(dpy, &event);
+        if (has_screensaver_extension &&
+                event.type == screensaver_event_base + ScreenSaverNotify) {
+            XScreenSaverNotifyEvent *notify = (XScreenSaverNotifyEvent *)&event;
+            bool on = notify->state == ScreenSaverOn;
+            if (on != screensaver_on) {
+                screensaver_on = on;
+                schedule_visibility_update();
+            }
+        } else if (event.type == PropertyNotify) {
+            // The window manager updates the stacking list whenever windows
+            // are mapped, unmapped, or restacked, and a client's state when
+            // it goes fullscreen or is minimised.
+            Atom atom = event.xproperty.atom;
+            if (atom == atom_net_client_list_stacking ||
+                    atom == atom_net_wm_state)
+                schedule_visibility_update();
+        }
+    }
+}
+
+static gboolean on_visibility_x_events(gint fd, GIOCondition condition,
+        gpointer user_data) {
+    process_visibility_x_events();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_dpms_poll(gpointer user_data) {
+    CARD16 power_level;
+    BOOL enabled;
+    bool off = DPMSInfo(visibility_xdisplay, &power_level, &enabled) &&
+        enabled && power_level != DPMSModeOn;
+    if (off != dpms_off) {
+        dpms_off = off;
+        update_visibility();
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+void start_visibility_tracking(GdkDisplay *display) {
+    // Wayland compositors don't let us see other clients' windows, so there
+    // this does nothing, and overlays are always visible.
+    if (!GDK_IS_X11_DISPLAY(display)) return;
+    Display *dpy = XOpenDisplay(gdk_display_get_name(display));
+    if (!dpy) return;
+    visibility_xdisplay = dpy;
+    Window root = DefaultRootWindow(dpy);
+
+    atom_net_client_list_stacking =
+        XInternAtom(dpy, "_NET_CLIENT_LIST_STACKING", False);
+    atom_net_wm_state = XInternAtom(dpy, "_NET_WM_STATE", False);
+    atom_net_wm_state_fullscreen =
+        XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+    atom_net_wm_state_hidden = XInternAtom(dpy, "_NET_WM_STATE_HIDDEN", False);
+    XSelectInput(dpy, root, PropertyChangeMask);
+
+    int error_base;
+    if (XScreenSaverQueryExtension(dpy, &screensaver_event_base,
+                &error_base)) {
+        has_screensaver_extension = TRUE;
+        XScreenSaverSelectInput(dpy, root, ScreenSaverNotifyMask);
+        XScreenSaverInfo *info = XScreenSaverAllocInfo();
+        if (XScreenSaverQueryInfo(dpy, root, info))
+            screensaver_on = info->state == ScreenSaverOn;
+        XFree(info);
+    }
+
+    int dpms_event_base, dpms_error_base;
+    if (DPMSQueryExtension(dpy, &dpms_event_base, &dpms_error_base) &&
+            DPMSCapable(dpy)) {
+        g_timeout_add(DPMS_POLL_INTERVAL_MS, on_dpms_poll, NULL);
+    }
+
+    g_unix_fd_add(ConnectionNumber(dpy), G_IO_IN, on_visibility_x_events,
+            NULL);
+    update_visibility();
+}
+
+//
+// Global input
+//
+
+// With --input-events, pages listening for 'input' events get the key,
+// button and pointer motion events of every input device, wherever they
+// happen.  The overlay window can't have keyboard focus (see the FAQ), so
+// these are XInput2 raw events, which go to whoever selects them on the root
+// window, whatever has focus or a grab.  They're read on our own X
+// connection, on the main loop, and only selected while some page listens.
+//
+// Raw motion events have device deltas, not a position, so a burst of them
+// is only used as a cue to ask for the pointer's position, once per frame.
+
+bool input_events_enabled = FALSE;
+// NULL if not enabled, or XInput2 isn't there.
+Display *input_xdisplay = NULL;
+int xi_opcode;
+bool input_selected = FALSE;
+// If nonzero, a pointer position is waiting for the next frame clock tick
+// (or idle, if the first overlay's window isn't on screen).
+guint input_motion_tick_id = 0;
+guint input_motion_idle_id = 0;
+
+static void process_input_x_events(void);
+
+// The pointer's position, in desktop coordinates.
+static bool query_pointer(int *x, int *y) {
+    Window root, child;
+    int window_x, window_y;
+    unsigned int mask;
+    return XQueryPointer(input_xdisplay, DefaultRootWindow(input_xdisplay),
+            &root, &child, x, y, &window_x, &window_y, &mask);
+}
+
+// Emits `data` to every overlay's pages, with the pointer position `x`, `y`
+// made relative to each overlay's window, the same as clickable areas are.
+static void emit_input_at(JSCValue *data, int x, int y, const char *key,
+        enum event_coalescing coalescing) {
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        JSCValue *copy = jsc_value_new_object(native_js_context, NULL, NULL);
+        char **names = jsc_value_object_enumerate_properties(data);
+        for (char **name = names; name && *name; ++name) {
+            JSCValue *value = jsc_value_object_get_property(data, *name);
+            jsc_value_object_set_property(copy, *name, value);
+            g_object_unref(value);
+        }
+        g_strfreev(names);
+        js_set_number(copy, "x", x - overlay->geometry.x);
+        js_set_number(copy, "y", y - overlay->geometry.y);
+        emit_event_to_layers(overlay, "input", key, copy, coalescing);
+    }
+    g_object_unref(data);
+}
+
+static void emit_pointer_motion(void) {
+    int x, y;
+    bool ok = query_pointer(&x, &y);
+    // Anything that arrived while we were waiting for the X server's reply
+    // has been read off the connection already, so the fd won't tell us
+    // about it.
+    process_input_x_events();
+    if (!ok) return;
+    JSCValue *data = jsc_value_new_object(native_js_context, NULL, NULL);
+    js_set_string(data, "type", "motion");
+    // Only the latest position matters, so motion the page hasn't been
+    // given yet is replaced.
+    emit_input_at(data, x, y, "motion", EVENT_LATEST);
+}
+
+static gboolean on_input_motion_tick(GtkWidget *widget, GdkFrameClock *clock,
+        gpointer user_data) {
+    emit_pointer_motion();
+    return G_SOURCE_REMOVE;
+}
+
+static void on_input_motion_tick_removed(gpointer user_data) {
+    // Also called if the window is destroyed before the tick.
+    input_motion_tick_id = 0;
+}
+
+static gboolean on_input_motion_idle(gpointer user_data) {
+    input_motion_idle_id = 0;
+    emit_pointer_motion();
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_pointer_motion(void) {
+    if (input_motion_tick_id || input_motion_idle_id) return;
+    if (overlays->len == 0) return;
+    GtkWidget *window =
+        ((struct overlay *)g_ptr_array_index(overlays, 0))->window;
+    if (gtk_widget_get_mapped(window))
+        input_motion_tick_id = gtk_widget_add_tick_callback(window,
+                on_input_motion_tick, NULL, on_input_motion_tick_removed);
+    else
+        input_motion_idle_id = g_idle_add(on_input_motion_idle, NULL);
+}
+
+static void process_input_x_events(void) {
+    Display *dpy = input_xdisplay;
+    while (XPending(dpy)) {
+        XEvent event;
+        XNextEvent(dpy, &event);
+        XGenericEventCookie *cookie = &event.xcookie;
+        if (cookie->type != GenericEvent || cookie->extension != xi_opcode
+                || !XGetEventData(dpy, cookie))
+            continue;
+        XIRawEvent *raw = cookie->data;
+        switch (cookie->evtype) {
+            case XI_RawKeyPress:
+            case XI_RawKeyRelease: {
+                KeySym keysym = XkbKeycodeToKeysym(dpy, raw->detail, 0, 0);
+                const char *name =
+                    keysym != NoSymbol ? XKeysymToString(keysym) : NULL;
+                JSCValue *data =
+                    jsc_value_new_object(native_js_context, NULL, NULL);
+                js_set_string(data, "type", "key");
+                js_set_boolean(data, "pressed",
+                        cookie->evtype == XI_RawKeyPress);
+                js_set_number(data, "keycode", raw->detail);
+                if (name) {
+                    js_set_string(data, "key", name);
+                } else {
+                    JSCValue *null = jsc_value_new_null(native_js_context);
+                    jsc_value_object_set_property(data, "key", null);
+                    g_object_unref(null);
+                }
+                emit_event_to_all("input", NULL, data, EVENT_QUEUE);
+                break;
+            }
+            case XI_RawButtonPress:
+            case XI_RawButtonRelease: {
+                // Events read while waiting for this reply are only in
+                // Xlib's queue, not on the fd, but XPending counts those
+                // too, so this loop still gets to them.
+                int x, y;
+                if (!query_pointer(&x, &y)) break;
+                JSCValue *data =
+                    jsc_value_new_object(native_js_context, NULL, NULL);
+                js_set_string(data, "type", "button");
+                js_set_boolean(data, "pressed",
+                        cookie->evtype == XI_RawButtonPress);
+                js_set_number(data, "button", raw->detail);
+                emit_input_at(data, x, y, NULL, EVENT_QUEUE);
+                break;
+            }
+            case XI_RawMotion:
+                schedule_pointer_motion();
+                break;
+        }
+        XFreeEventData(dpy, cookie);
+    }
+}
+
+static gboolean on_input_x_events(gint fd, GIOCondition condition,
+        gpointer user_data) {
+    process_input_x_events();
+    return G_SOURCE_CONTINUE;
+}
+
+// Selects raw input events if some page listens for 'input' events, and
+// stops if none do.  Call whenever subscriptions might have changed.
+void update_input_events(void) {
+    if (!input_xdisplay) return;
+    bool wanted = anyone_is_subscribed("input");
+    if (wanted == input_selected) return;
+
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    if (wanted) {
+        XISetMask(bits, XI_RawKeyPress);
+        XISetMask(bits, XI_RawKeyRelease);
+        XISetMask(bits, XI_RawButtonPress);
+        XISetMask(bits, XI_RawButtonRelease);
+        XISetMask(bits, XI_RawMotion);
+    }
+    // Master devices, so input from a device that's part of the core
+    // keyboard or pointer (as most are) only arrives once.
+    XIEventMask mask = {
+        .deviceid = XIAllMasterDevices,
+        .mask_len = sizeof bits,
+        .mask = bits,
+    };
+    XISelectEvents(input_xdisplay, DefaultRootWindow(input_xdisplay),
+            &mask, 1);
+    XFlush(input_xdisplay);
+    input_selected = wanted;
+}
+
+void start_input_events(GdkDisplay *display) {
+    if (!GDK_IS_X11_DISPLAY(display)) {
+        g_warning("--input-events only works on X11; ignoring it");
+        return;
+    }
+    Display *dpy = XOpenDisplay(gdk_display_get_name(display));
+    if (!dpy) return;
+
+    // Raw events go to the root window regardless of grabs since XInput 2.1.
+    // An older server still says Success, but lowers the version it returns.
+    int event_base, error_base;
+    int major = 2, minor = 1;
+    if (!XQueryExtension(dpy, "XInputExtension", &xi_opcode,
+                &event_base, &error_base) ||
+            XIQueryVersion(dpy, &major, &minor) != Success ||
+            major < 2 || (major == 2 && minor < 1)) {
+        g_warning("The X server doesn't have XInput 2.1; "
+                "--input-events won't work");
+        XCloseDisplay(dpy);
+        return;
+    }
+    input_xdisplay = dpy;
+    g_unix_fd_add(ConnectionNumber(dpy), G_IO_IN, on_input_x_events, NULL);
+    // Pages may have started listening already.
+    update_input_events();
+}
+
+//
+// Hot reload
+//
+
+// With --watch, files changing anywhere under a directory make every page
+// reload, in the same web views, so the web process stays warm and nothing
+// else is torn down.  If only stylesheets changed, pages instead get fresh
+// copies of their stylesheets in place, keeping their state.
+//
+// Editors tend to save with a burst of writes, renames, and deletions, so
+// changes are collected until there's been none for WATCH_DEBOUNCE_MS.
+
+char *watch_dir = NULL;
+#define WATCH_DEBOUNCE_MS 100
+int watch_fd = -1;
+// Watched directories' paths, by watch descriptor.
+GHashTable *watched_dirs;
+guint watch_debounce_id = 0;
+bool watch_saw_non_css = FALSE;
+
+// Each stylesheet link is replaced by a copy with a new URL, so it's fetched
+// again, and the old one is only removed once the new one has loaded, so
+// there's no flash of unstyled page in between.
+static const char reload_stylesheets_js[] =
+    "for (const link of document.querySelectorAll('link[rel~=stylesheet]')) {"
+    "  const url = new URL(link.href);"
+    "  url.searchParams.set('hudkit-reload', Date.now());"
+    "  const fresh = link.cloneNode();"
+    "  fresh.href = url.href;"
+    "  fresh.onload = fresh.onerror = () => link.remove();"
+    "  link.after(fresh);"
+    "}";
+
+// Watches `path`, and every directory under it.
+static void watch_tree(const char *path) {
+    int wd = inotify_add_watch(watch_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO
+            | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    if (wd < 0) {
+        g_warning("Can't watch %s: %s", path, g_strerror(errno));
+        return;
+    }
+    g_hash_table_insert(watched_dirs, GINT_TO_POINTER(wd), g_strdup(path));
+
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (!dir) return;
+    const char *name;
+    while ((name = g_dir_read_name(dir))) {
+        char *child = g_build_filename(path, name, NULL);
+        if (name[0] != '.' && g_file_test(child, G_FILE_TEST_IS_DIR)
+                && !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+            watch_tree(child);
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+static gboolean on_watch_settled(gpointer user_data) {
+    watch_debounce_id = 0;
+    bool css_only = !watch_saw_non_css;
+    watch_saw_non_css = FALSE;
+
+    for (int i = 0; i < overlays->len; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        for (int j = 0; j < overlay->layers->len; ++j) {
+            struct layer *layer = g_ptr_array_index(overlay->layers, j);
+            if (!css_only) {
+                webkit_web_view_reload_bypass_cache(layer->web_view);
+                continue;
+            }
+            gint64 *start = g_new(gint64, 1);
+            *start = g_get_monotonic_time();
+            webkit_web_view_evaluate_javascript(layer->web_view,
+                    reload_stylesheets_js, -1, NULL, NULL, NULL,
+                    on_js_call_finished, start);
+        }
+    }
+    g_message("Files changed under %s; %s", watch_dir,
+            css_only ? "reloaded stylesheets" : "reloaded pages");
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_watch_events(gint fd, GIOCondition condition,
+        gpointer user_data) {
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    bool relevant = FALSE;
+    while ((length = read(fd, buffer, sizeof buffer)) > 0) {
+        for (char *p = buffer; p < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof *event + event->len;
+            if (event->mask & IN_IGNORED) {
+                g_hash_table_remove(watched_dirs, GINT_TO_POINTER(event->wd));
+                continue;
+            }
+            // Hidden files and backups are editors' business, like vim's
+            // swap files.
+            if (!event->len || event->name[0] == '.'
+                    || g_str_has_suffix(event->name, "~"))
+                continue;
+
+            if (event->mask & IN_ISDIR) {
+                // New directories need watching too, and might already have
+                // files in them.
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    const char *parent = g_hash_table_lookup(watched_dirs,
+                            GINT_TO_POINTER(event->wd));
+                    if (parent) {
+                        char *path = g_build_filename(parent, event->name,
+                                NULL);
+                        watch_tree(path);
+                        g_free(path);
+                    }
+                }
+                watch_saw_non_css = TRUE;
+            } else if (event->mask & IN_CREATE) {
+                // Not written yet; its IN_CLOSE_WRITE comes later.
+                continue;
+            } else if (!g_str_has_suffix(event->name, ".css")) {
+                watch_saw_non_css = TRUE;
+            }
+            relevant = TRUE;
+        }
+    }
+
+    if (relevant) {
+        // Restart the wait every time, so we act once the burst is over.
+        if (watch_debounce_id) g_source_remove(watch_debounce_id);
+        watch_debounce_id = g_timeout_add(WATCH_DEBOUNCE_MS,
+                on_watch_settled, NULL);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+void start_watching(void) {
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        fprintf(stderr, "Can't watch --watch %s: %s\n", watch_dir,
+                g_strerror(errno));
+        exit(9);
+    }
+    watched_dirs = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    watch_tree(watch_dir);
+    if (g_hash_table_size(watched_dirs) == 0) {
+        fprintf(stderr, "Can't watch --watch %s\n", watch_dir);
+        exit(9);
+    }
+    g_unix_fd_add(watch_fd, G_IO_IN, on_watch_events, NULL);
+}
+
+// These handle calls from the page's JavaScript.  Each gets the value the
+// page posted, and answers through `reply`, which resolves (or with an error
+// message, rejects) the Promise the page's `postMessage` call returned.  The
+// values go across as structured data, so nothing needs to be turned into
+// JavaScript source and evaluated.
+
+gboolean on_js_call_get_monitor_layout(WebKitUserContentManager *manager,
+        JSCValue *jsValue,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    webkit_script_message_reply_return_value(reply, monitor_layout.value);
+    return TRUE;
+}
+
+gboolean on_js_call_get_window_geometry(WebKitUserContentManager *manager,
+        JSCValue *jsValue,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+    JSCValue *response = js_rectangle_new(&layer->overlay->geometry);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+
+// Reads rectangles the page sent into `rects`, replacing what was there.
+// The JS side always sends them packed into an Int32Array, as consecutive x,
+// y, width, height quadruples.  That's exactly the memory layout of an array
+// of cairo_rectangle_int_t, so we can copy them in one go, instead of looking
+// up 4 properties on each of thousands of rectangle objects.
+//
+// Returns FALSE if it isn't an Int32Array.
+static bool read_js_rectangles(JSCValue *jsRectangles, GArray *rects) {
+    G_STATIC_ASSERT(sizeof(cairo_rectangle_int_t) == 4 * sizeof(gint32));
+    if (!jsc_value_is_typed_array(jsRectangles) ||
+            jsc_value_get_typed_array_type(jsRectangles)
+                != JSC_TYPED_ARRAY_INT32)
+        return FALSE;
+    gsize nInts = 0;
+    gint32 *ints = jsc_value_typed_array_get_data(jsRectangles, &nInts);
+    // Any incomplete quadruple at the end is ignored.
+    int nRectangles = nInts / 4;
+    g_array_set_size(rects, 0);
+    g_array_append_vals(rects, ints, nRectangles);
+    return TRUE;
+}
+
+gboolean on_js_call_set_clickable_areas(WebKitUserContentManager *manager,
+        JSCValue *jsRectangles,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+
+    if (!read_js_rectangles(jsRectangles, layer->user_defined_input_rects)) {
+        webkit_script_message_reply_return_error_message(reply,
+                "setClickableAreas: expected an Int32Array");
+        return TRUE;
+    }
+
+    queue_input_shape(layer->overlay);
+
+    JSCValue *response = jsc_value_new_undefined(native_js_context);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+
+// Takes the same rectangles as `on_js_call_set_clickable_areas`, or null to
+// go back to detecting what's painted.
+gboolean on_js_call_set_painted_areas(WebKitUserContentManager *manager,
+        JSCValue *jsRectangles,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+
+    if (jsc_value_is_null(jsRectangles)) {
+        layer->declares_painted_areas = FALSE;
+        g_array_set_size(layer->painted_rects, 0);
+    } else if (read_js_rectangles(jsRectangles, layer->painted_rects)) {
+        layer->declares_painted_areas = TRUE;
+    } else {
+        webkit_script_message_reply_return_error_message(reply,
+                "setPaintedAreas: expected an Int32Array, or null");
+        return TRUE;
+    }
+
+    queue_input_shape(layer->overlay);
+
+    JSCValue *response = jsc_value_new_undefined(native_js_context);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+
+gboolean on_js_call_show_inspector(WebKitUserContentManager *manager,
+        JSCValue *jsStartAttached,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+    bool startAttached = jsc_value_to_boolean(jsStartAttached);
+
+    show_inspector(layer, startAttached);
+
+    JSCValue *response = jsc_value_new_undefined(native_js_context);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+gboolean on_js_call_set_frame_rate_limit(WebKitUserContentManager *manager,
+        JSCValue *jsLimit,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+
+    // null goes back to the --max-fps default.
+    if (jsc_value_is_null(jsLimit)) {
+        layer->page_fps_limit = -1;
+    } else if (jsc_value_is_number(jsLimit) &&
+            jsc_value_to_double(jsLimit) >= 0) {
+        layer->page_fps_limit = jsc_value_to_double(jsLimit);
+    } else {
+        webkit_script_message_reply_return_error_message(reply,
+                "setFrameRateLimit: expected a non-negative number, or null");
+        return TRUE;
+    }
+    emit_frame_rate_limit(layer);
+
+    JSCValue *response = jsc_value_new_undefined(native_js_context);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+// Takes an optional boolean: whether to start counting from scratch after
+// answering.  The stats are of the whole window, which all its layers share.
+gboolean on_js_call_get_frame_stats(WebKitUserContentManager *manager,
+        JSCValue *jsReset,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+    struct overlay *overlay = layer->overlay;
+    JSCValue *response = js_frame_stats_new(overlay);
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    if (jsc_value_to_boolean(jsReset)) frame_stats_reset(overlay);
+    return TRUE;
+}
+
+// The page keeps one of these outstanding at all times.  We hold onto the
+// reply until the next frame that has events queued, and answer with all of
+// them; the page then immediately asks again.
+gboolean on_js_call_events(WebKitUserContentManager *manager,
+        JSCValue *jsValue,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+    struct event_queue *events = &layer->events;
+    if (events->reply) {
+        // Shouldn't happen, but if it does, the newer request wins.
+        webkit_script_message_reply_return_error_message(events->reply,
+                "superseded by a newer request for events");
+        webkit_script_message_reply_unref(events->reply);
+    }
+    events->reply = webkit_script_message_reply_ref(reply);
+    schedule_event_delivery(layer);
+    return TRUE;
+}
+
+// Some events have a current state, which a page that starts listening
+// should get straight away, rather than only once it next changes.
+static void on_event_subscribed(struct layer *layer, const char *name) {
+    if (!strcmp(name, "frame-rate-limit")) emit_frame_rate_limit(layer);
+    if (!strcmp(name, "visibility")) emit_visibility(layer);
+}
+
+// The page tells us when it gains its first listener for an event, or loses
+// its last one, as an Array `[eventName, isSubscribed]`.
+gboolean on_js_call_subscribe(WebKitUserContentManager *manager,
+        JSCValue *jsValue,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    struct layer *layer = arg;
+    JSCValue *jsName = jsc_value_object_get_property_at_index(jsValue, 0);
+    JSCValue *jsIsSubscribed =
+        jsc_value_object_get_property_at_index(jsValue, 1);
+
+    if (jsc_value_is_string(jsName)) {
+        char *name = jsc_value_to_string(jsName);
+        if (jsc_value_to_boolean(jsIsSubscribed)) {
+            // The table takes ownership of the name.
+            g_hash_table_add(layer->events.subscribed, name);
+            on_event_subscribed(layer, name);
+        } else {
+            g_hash_table_remove(layer->events.subscribed, name);
+            g_free(name);
+        }
+        update_metrics_sampler();
+        update_input_events();
+        update_frame_events(layer->overlay);
+        JSCValue *response = jsc_value_new_undefined(native_js_context);
+        webkit_script_message_reply_return_value(reply, response);
+        g_object_unref(response);
+    } else {
+        webkit_script_message_reply_return_error_message(reply,
+                "event name must be a string");
+    }
+    g_object_unref(jsName);
+    g_object_unref(jsIsSubscribed);
+    return TRUE;
+}
+
+static gboolean on_first_draw_after_commit(GtkWidget *web_view, cairo_t *cr,
+        gpointer user_data) {
+    struct layer *layer = user_data;
+    startup_trace("first paint after load committed (%s)",
+            webkit_web_view_get_uri(WEBKIT_WEB_VIEW(web_view)));
+    layer->startup_traced = TRUE;
+    g_signal_handlers_disconnect_by_func(web_view,
+            on_first_draw_after_commit, user_data);
+    return FALSE;
+}
+
+void on_page_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+        gpointer user_data) {
+    struct layer *layer = user_data;
+
+    // Once a new page is committed to, the old one is gone, and so are its
+    // listeners and its request for events.
+    if (load_event == WEBKIT_LOAD_COMMITTED) {
+        event_queue_reset(&layer->events);
+        layer->page_fps_limit = -1;
+        update_metrics_sampler();
+        update_input_events();
+        update_frame_events(layer->overlay);
+        // What it painted is still shown until the new page paints over it,
+        // so only what the old page declared is forgotten.
+        if (layer->declares_painted_areas) {
+            layer->declares_painted_areas = FALSE;
+            g_array_set_size(layer->painted_rects, 0);
+            queue_input_shape(layer->overlay);
+        }
+    }
+
+    if (startup_trace_enabled && !layer->startup_traced) {
+        const char *uri = webkit_web_view_get_uri(web_view);
+        if (load_event == WEBKIT_LOAD_COMMITTED) {
+            startup_trace("load committed (%s)", uri);
+            g_signal_connect_after(web_view, "draw",
+                    G_CALLBACK(on_first_draw_after_commit), layer);
+        } else if (load_event == WEBKIT_LOAD_FINISHED) {
+            startup_trace("load finished (%s)", uri);
+        }
+    }
+}
+
+// Repeated crashes back off exponentially from the minimum to the maximum
+// delay, so a page that crashes as soon as it loads doesn't keep a core busy,
+// but it's always back within the maximum.  A page that stays up long enough
+// is considered healthy again, and its next crash gets reloaded straight away.
+#define RESTART_DELAY_MIN_MS 100
+#define RESTART_DELAY_MAX_MS 5000
+#define RESTART_HEALTHY_AFTER_S 60
+
+static gboolean on_restart_layer(gpointer user_data) {
+    struct layer *layer = user_data;
+    layer->restart_id = 0;
+    layer->last_restart_time = g_get_monotonic_time();
+    webkit_web_view_reload(layer->web_view);
+    return G_SOURCE_REMOVE;
+}
+
+// WebKit starts a new web process for a web view whose old one is gone, but
+// only once it's told to load something.  Until then, the window just shows
+// nothing, so we reload the page for it.
+void on_web_process_terminated(WebKitWebView *web_view,
+        WebKitWebProcessTerminationReason reason, gpointer user_data) {
+    struct layer *layer = user_data;
+
+    // The page is gone, and so are its listeners and its request for events.
+    event_queue_reset(&layer->events);
+    layer->page_fps_limit = -1;
+    update_metrics_sampler();
+    update_input_events();
+    update_frame_events(layer->overlay);
+
+    gint64 since_last = g_get_monotonic_time() - layer->last_restart_time;
+    if (reason == WEBKIT_WEB_PROCESS_TERMINATED_BY_API ||
+            since_last > RESTART_HEALTHY_AFTER_S * G_USEC_PER_SEC) {
+        layer->restart_delay_ms = 0;
+    } else {
+        layer->restart_delay_ms = CLAMP(layer->restart_delay_ms * 2,
+                RESTART_DELAY_MIN_MS, RESTART_DELAY_MAX_MS);
+    }
+    ++memory_stats.restarts;
+
+    const char *what =
+        reason == WEBKIT_WEB_PROCESS_CRASHED ? "crashed" :
+        reason == WEBKIT_WEB_PROCESS_EXCEEDED_MEMORY_LIMIT
+            ? "went over its memory limit" :
+        "was restarted";
+    char *peak = memory_limit_mib > 0
+        ? g_strdup_printf("; peak web process RSS %.1f MiB",
+                memory_stats.peak_rss_kib / 1024.0)
+        : g_strdup("");
+    g_warning("Web process for %s %s; reloading in %u ms (restart %llu%s)",
+            webkit_web_view_get_uri(web_view), what, layer->restart_delay_ms,
+            (unsigned long long)memory_stats.restarts, peak);
+    g_free(peak);
+
+    if (layer->restart_id) g_source_remove(layer->restart_id);
+    layer->restart_id = g_timeout_add(layer->restart_delay_ms,
+            on_restart_layer, layer);
+}
+
+gboolean on_js_call_get_stats(WebKitUserContentManager *manager,
+        JSCValue *jsValue,
+        WebKitScriptMessageReply *reply,
+        gpointer arg) {
+    JSCValue *response = js_stats_new();
+    webkit_script_message_reply_return_value(reply, response);
+    g_object_unref(response);
+    return TRUE;
+}
+
+typedef gboolean (*js_call_handler)(WebKitUserContentManager *manager,
+        JSCValue *value, WebKitScriptMessageReply *reply, gpointer arg);
+
+// Every call a page can make.  Each appears to it as
+// window.webkit.messageHandlers[name], whose `postMessage` returns a Promise
+// of whatever the handler replies with.
+static const struct {
+    const char *name;
+    js_call_handler handler;
+    enum latency_stat_id stat;
+} js_calls[] = {
+    { "getMonitorLayout", on_js_call_get_monitor_layout,
+        STAT_GET_MONITOR_LAYOUT },
+    { "getWindowGeometry", on_js_call_get_window_geometry,
+        STAT_GET_WINDOW_GEOMETRY },
+    { "setClickableAreas", on_js_call_set_clickable_areas,
+        STAT_SET_CLICKABLE_AREAS },
+    { "setPaintedAreas", on_js_call_set_painted_areas,
+        STAT_SET_PAINTED_AREAS },
+    { "showInspector", on_js_call_show_inspector, STAT_SHOW_INSPECTOR },
+    { "setFrameRateLimit", on_js_call_set_frame_rate_limit,
+        STAT_SET_FRAME_RATE_LIMIT },
+    { "getFrameStats", on_js_call_get_frame_stats, STAT_GET_FRAME_STATS },
+    { "getStats", on_js_call_get_stats, STAT_GET_STATS },
+    { "_events", on_js_call_events, STAT_EVENTS },
+    { "_subscribe", on_js_call_subscribe, STAT_SUBSCRIBE },
+};
+
+// Which layer, and which of `js_calls`, a signal connection is for.
+struct js_call_binding {
+    struct layer *layer;
+    int call;
+};
+
+// Runs the handler for a call from a page, and times it.
+static gboolean on_js_call(WebKitUserContentManager *manager,
+        JSCValue *value,
+        WebKitScriptMessageReply *reply,
+        gpointer user_data) {
+    struct js_call_binding *binding = user_data;
+    gint64 start = g_get_monotonic_time();
+    gboolean handled = js_calls[binding->call].handler(
+            manager, value, reply, binding->layer);
+    latency_stat_record(js_calls[binding->call].stat, start);
+    return handled;
+}
+
+void on_inspector_size_allocate(GtkWidget *inspector_web_view,
+        GdkRectangle *allocation,
+        gpointer user_data) {
+    // Whenever the inspector (which when this is called is attached to the
+    // overlay window) moves or is resized, change the input shape to "follow"
+    // it, so that it always remains clickable.
+    struct layer *layer = user_data;
+
+    layer->attached_inspector_input_rect.x = allocation->x;
+    layer->attached_inspector_input_rect.y = allocation->y;
+    layer->attached_inspector_input_rect.width = allocation->width;
+    layer->attached_inspector_input_rect.height = allocation->height;
+
+    queue_input_shape(layer->overlay);
+}
+
+void show_attached_inspector_no_keyboard_advice(WebKitWebView *web_view) {
+    gint64 *start = g_new(gint64, 1);
+    *start = g_get_monotonic_time();
+    webkit_web_view_evaluate_javascript(
+        web_view,
+        "console.info('Note that when the Web Inspector is"
+            " attached to the Hudkit window, you cannot type into it, because"
+            " the overlay window does not receive keyboard events.  To type"
+            " into this console, detach the Inspector into its own window.')",
+        -1, // `length` (-1 indicates a NULL-terminated string)
+        NULL, // `world_name` (NULL indicates default)
+        NULL, // `source_uri` (NULL indicates there's no associated file)
+        NULL, // `cancellable` (NULL indicates we don't care)
+        on_js_call_finished, // callback
+        start // `user_data`
+    );
+}
+bool on_inspector_attach(WebKitWebInspector *inspector, gpointer user_data) {
+    // When the web inspector attaches to the overlay window, begin tracking
+    // its allocated position on screen.
+    struct layer *layer = user_data;
+
+    WebKitWebViewBase *inspector_web_view = webkit_web_inspector_get_web_view(
+            inspector);
+    layer->inspector_size_allocate_handler_id =
+        g_signal_connect(GTK_WIDGET(inspector_web_view), "size-allocate",
+                G_CALLBACK(on_inspector_size_allocate), layer);
+
+    static GOnce show_no_keyboard_advice_once = G_ONCE_INIT;
+    g_once(&show_no_keyboard_advice_once,
+            (void * (*)(void *))show_attached_inspector_no_keyboard_advice,
+            layer->web_view);
+
+    return FALSE; // Allow attach
+}
+bool on_inspector_detach(WebKitWebInspector *inspector, gpointer user_data) {
+    // When the web inspector detaches from the overlay window, stop tracking
+    // its position, and zero out its input shape rectangle.
+    struct layer *layer = user_data;
+
+    WebKitWebViewBase *inspector_web_view = webkit_web_inspector_get_web_view(
+            inspector);
+    if (layer->inspector_size_allocate_handler_id)
+        g_signal_handler_disconnect(GTK_WIDGET(inspector_web_view),
+                layer->inspector_size_allocate_handler_id);
+    layer->inspector_size_allocate_handler_id = 0;
+    layer->attached_inspector_input_rect.x = 0;
+    layer->attached_inspector_input_rect.y = 0;
+    layer->attached_inspector_input_rect.width = 0;
+    layer->attached_inspector_input_rect.height = 0;
+    queue_input_shape(layer->overlay);
+    return FALSE; // Allow detach
+}
+
+bool on_page_load_failed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+        gchar *failing_uri, GError *error, gpointer user_data) {
+    // Show a custom error page
+    char page_content[2000];
+    snprintf(page_content, sizeof(page_content), "\
+<html>\n\
+<head>\n\
+<style>\n\
+    body { background : rgba(255,0,0,0.2) }\n\
+    h1 { color : white; filter: drop-shadow(0 0 0.75rem black); }\n\
+</style>\n\
+</head>\n\
+<h1>%s<br>%s</h1>\n\
+</html>", error->message, failing_uri);
+    // `failing_uri` is URL-escaped, so it's fine to inject.
+    // TODO URI-escape the error message for maximum paranoia?
+    webkit_web_view_load_alternate_html(
+            web_view, page_content, failing_uri, NULL);
+
+    // Don't call other handlers
+    return FALSE;
+}
+
+void printUsage(char *programName) {
+    printf(
+"USAGE: %s <URL>... [--help] [--startup-trace] [--per-monitor]"
+"\n       [--max-fps <fps>] [--cpu-budget <percent>] [--memory-limit <MiB>]"
+"\n       [--frame-stats-file <path>] [--stats-file <path>]"
+"\n       [--export-frames <name>] [--headless <layout>]"
+"\n       [--headless-checksums <file>] [--headless-png <dir>]"
+"\n       [--headless-frames <n>] [--watch <dir>]"
+"\n       [--data-socket <path>] [--data-fifo <path>] [--data-framing lines|length]"
+"\n       [--metrics-interval <ms>] [--cache-dir <dir>] [--cache-model <model>]"
+"\n       [--bundle <file>] [--bundle-header <header>]..."
+"\n       [--shape-to-painted] [--clickable-alpha <min>] [--input-events]"
+"\n       [--webkit-settings option1=value1,...]"
+"\n"
+"\n       %s --make-bundle <directory> <file>"
+"\n"
+"\n    <URL>"
+"\n        Universal Resource Locator to be loaded in the overlay window."
+"\n        For example, to load a local file, you'd pass something like:"
+"\n"
+"\n            file:///home/mary/test.html"
+"\n"
+"\n        or to load from a local web server at port 4000:"
+"\n"
+"\n            http://localhost:4000"
+"\n"
+"\n        Given more than one, each page gets its own layer in the overlay"
+"\n        window, stacked in the order given: the first is at the bottom.  Each"
+"\n        has its own clickable areas.  They share one network process and"
+"\n        cache, and within a window, one web process where WebKit allows it,"
+"\n        so several HUDs cost much less this way than as separate hudkits."
+"\n"
+"\n    --inspect"
+"\n        Open the Web Inspector (dev tools) on start."
+"\n"
+"\n    --startup-trace"
+"\n        Print to stderr how long after startup each phase of it happens, up"
+"\n        to the page's first paint."
+"\n"
+"\n    --per-monitor"
+"\n        Create a separate overlay window for each monitor, sized to exactly"
+"\n        that monitor, instead of one window covering all of them.  Each"
+"\n        window loads its own copy of each <URL>.  Saves memory and"
+"\n        compositing work when monitors are arranged such that their"
+"\n        bounding box has lots of area no monitor shows."
+"\n"
+"\n    --shape-to-painted"
+"\n        Shape the overlay window to just the parts of it that are painted"
+"\n        (or clickable), so the compositor doesn't have to blend the whole"
+"\n        desktop every frame.  Pages can say what they paint with"
+"\n        Hudkit.setPaintedAreas; otherwise it's detected twice a second, so"
+"\n        something drawn where nothing was before may take that long to show."
+"\n"
+"\n    --clickable-alpha <min>"
+"\n        Make every pixel a page renders with at least alpha <min> (1 to 255)"
+"\n        clickable, in addition to the areas it makes clickable itself.  Kept"
+"\n        up to date from what the page redraws, at most 20 times a second."
+"\n"
+"\n    --input-events"
+"\n        Let pages listen for 'input' events: every key press and release,"
+"\n        mouse button, and pointer movement on the X server, whichever window"
+"\n        they go to.  Off by default, since it lets any page you load see"
+"\n        everything you type."
+"\n"
+"\n    --watch <dir>"
+"\n        Whenever files under <dir> change, reload the pages, without"
+"\n        restarting anything else, for quicker iteration while developing"
+"\n        them.  If only .css files changed, the pages' stylesheets are"
+"\n        swapped in place instead, so they keep their state.  Hidden files"
+"\n        and ones ending in ~ are ignored.  (A --bundle isn't re-read, so"
+"\n        this is for pages served from files or a local web server.)"
+"\n"
+"\n    --bundle <file>"
+"\n        Serve the files in bundle <file> (made with --make-bundle) under"
+"\n        hudkit://, so the page can be loaded from one file without a web"
+"\n        server.  Paths are as they were in the bundled directory, so"
+"\n        hudkit://bundle/js/main.js serves its js/main.js.  (The host part"
+"\n        is ignored.)  If no <URL> is given, hudkit://bundle/ is loaded,"
+"\n        which serves index.html."
+"\n"
+"\n    --bundle-header <header>"
+"\n        Add an HTTP header like 'Cross-Origin-Opener-Policy: same-origin'"
+"\n        to every response served from --bundle.  Can be given many times."
+"\n"
+"\n    --make-bundle <directory> <file>"
+"\n        Pack every file in <directory> into bundle <file>, for --bundle,"
+"\n        then exit."
+"\n"
+"\n    --cache-dir <dir>"
+"\n        Keep WebKit's disk cache, cookies, local storage, and so on in <dir>,"
+"\n        so they survive restarts.  Scripts, fonts, and images the page"
+"\n        loads then don't have to be fetched and parsed again every time."
+"\n        By default, nothing is kept."
+"\n"
+"\n    --cache-model <model>"
+"\n        How much WebKit caches: document-viewer (almost nothing),"
+"\n        web-browser (the most), or document-browser (in between)."
+"\n        Default: web-browser with --cache-dir, document-viewer without."
+"\n"
+"\n    --max-fps <fps>"
+"\n        Limit how often the page's requestAnimationFrame callbacks run, and"
+"\n        so how often it repaints, to <fps> times per second.  Pages can"
+"\n        change their own limit with Hudkit.setFrameRateLimit.  0 means no"
+"\n        limit, which is the default."
+"\n"
+"\n    --cpu-budget <percent>"
+"\n        Lower the frame rate limit automatically while hudkit and its WebKit"
+"\n        processes together use more than <percent> of one CPU core, and"
+"\n        raise it again once they don't.  Like --max-fps, this only slows"
+"\n        requestAnimationFrame callbacks, not CSS animations, timers, or"
+"\n        video, so if lowering the limit doesn't bring CPU use down, it's"
+"\n        put back, and not lowered again for 30 seconds."
+"\n"
+"\n    --memory-limit <MiB>"
+"\n        Keep each WebKit web process under <MiB> megabytes.  WebKit frees"
+"\n        caches as one gets close, and one that goes over is restarted."
+"\n        Hudkit also garbage collects JavaScript objects at 75%% of it, and"
+"\n        restarts web processes itself if they're still over 90%% after that."
+"\n        (With or without this, pages whose web process crashes are reloaded,"
+"\n        backing off to at most every 5 seconds if it keeps happening, and"
+"\n        each restart is logged on stderr, with peak RSS if this is set.)"
+"\n"
+"\n    --data-socket <path>"
+"\n        Listen on a Unix domain socket at <path>, and pass every message"
+"\n        clients send to the page, as a 'data' event.  For example:"
+"\n"
+"\n            echo hello | socat - UNIX-CONNECT:<path>"
+"\n"
+"\n    --data-fifo <path>"
+"\n        Like --data-socket, but read from a named pipe (FIFO) at <path>,"
+"\n        creating it if it doesn't exist.  For example:"
+"\n"
+"\n            echo hello > <path>"
+"\n"
+"\n    --data-framing lines|length"
+"\n        How messages are separated in --data-socket and --data-fifo input."
+"\n        With 'lines' (the default), each line is a message, passed to the"
+"\n        page as a string.  With 'length', each message is a 4-byte"
+"\n        big-endian length followed by that many bytes, passed to the page"
+"\n        as an ArrayBuffer."
+"\n"
+"\n    --metrics-interval <ms>"
+"\n        How often pages listening for 'metrics' events get them, in"
+"\n        milliseconds.  Default: 1000."
+"\n"
+"\n    --frame-stats-file <path>"
+"\n        Every 10 seconds, append each overlay's frame timing statistics to"
+"\n        the file at <path>, as a line of JSON.  They're in the same format"
+"\n        as Hudkit.getFrameStats returns, and count from the start."
+"\n"
+"\n    --stats-file <path>"
+"\n        Every 10 seconds, append Hudkit's internal counters and latency"
+"\n        histograms to the file at <path>, as a line of JSON.  They're in"
+"\n        the same format as Hudkit.getStats returns."
+"\n"
+"\n    --export-frames <name>"
+"\n        Publish every frame the overlay renders, with alpha, into POSIX"
+"\n        shared memory <name> (like /hudkit), so streaming or recording"
+"\n        software can composite it without capturing the screen.  With"
+"\n        --per-monitor, each overlay's is <name>.<connector>, like"
+"\n        /hudkit.DP-1.  See the readme for the layout."
+"\n"
+"\n    --headless <layout>"
+"\n        Render offscreen, without showing anything or needing a compositor,"
+"\n        as if the monitors were laid out like <layout>: a comma-separated"
+"\n        list of <width>x<height>, each optionally followed by +<x>+<y>, like"
+"\n        1920x1080,1280x1024+1920+0.  Monitors without a position go to the"
+"\n        right of the one before.  They're at scale 1 and 60 Hz.  The page's"
+"\n        JavaScript API works as usual.  Still needs an X display, such as"
+"\n        Xvfb."
+"\n"
+"\n    --headless-checksums <file>"
+"\n        With --headless, write a line of JSON to <file> for each frame"
+"\n        drawn, with its number, time since startup, size, and a SHA-1"
+"\n        checksum of its pixels."
+"\n"
+"\n    --headless-png <dir>"
+"\n        With --headless, save each frame drawn in <dir>, as"
+"\n        frame-000001.png and so on."
+"\n"
+"\n    --headless-frames <n>"
+"\n        With --headless, exit after <n> frames have been drawn."
+"\n"
+"\n    --webkit-settings <settings>"
+"\n        The <settings> should be a comma-separated list of settings."
+"\n"
+"\n        Boolean settings can look like"
+"\n            option-name"
+"\n            option-name=TRUE"
+"\n            option-name=FALSE"
+"\n"
+"\n        String, integer, and enum options look like"
+"\n            option-name=foo"
+"\n            option-name=42"
+"\n"
+"\n        To see settings available on your system's WebKit version, their"
+"\n        valid values, and default values, pass '--webkit-settings help'."
+"\n"
+"\n        To see explanations of the settings, see"
+"\n        https://webkitgtk.org/reference/webkit2gtk/stable/WebKitSettings.html"
+"\n"
+"\n    --help"
+"\n        Print this help text, then exit."
+"\n"
+"\n    All of the standard GTK debug options and env variables are also"
+"\n    supported.  You probably won't need them, but you can find a list here:"
+"\n    https://developer.gnome.org/gtk3/stable/gtk-running.html"
+"\n",
+        programName, programName);
+}
+
+// Creates a layer loading the given URL, on top of the overlay's others.
+// `related_view` is the web view whose web process it should share, if any.
+static struct layer *layer_new(struct overlay *overlay, const char *url,
+        WebKitWebView *related_view) {
+    struct layer *layer = g_new0(struct layer, 1);
+    layer->overlay = overlay;
+
+    // Initialise the array of user-JS-defined clickable areas to empty
+    layer->user_defined_input_rects = g_array_new(
+            FALSE, // don't NULL-terminate
+            TRUE,  // zero memory
+            sizeof(cairo_rectangle_int_t));
+    layer->painted_rects = g_array_new(FALSE, TRUE,
+            sizeof(cairo_rectangle_int_t));
+    event_queue_init(&layer->events);
+    layer->page_fps_limit = -1;
+
+    //
+    // Set up the WebKit web view widget
+    //
+
+    // Every web view shares the same context, so with --per-monitor, or more
+    // than one layer, they still share one network process, cache, and so
+    // on.  Layers above the first in a window are also created as related to
+    // it, which makes WebKit put them in the same web process, where it can.
+    // Each still gets its own user content manager, since the message
+    // handlers we register on it are bound to the layer.
+    WebKitUserContentManager *manager = webkit_user_content_manager_new();
+    WebKitWebView *web_view = WEBKIT_WEB_VIEW(g_object_new(
+                WEBKIT_TYPE_WEB_VIEW,
+                "web-context", wk_context,
+                "related-view", related_view,
+                "user-content-manager", manager,
+                NULL));
+    // The web view holds its own reference.
+    g_object_unref(manager);
+    layer->web_view = web_view;
+
+    // Set up a callback to react to window.close() being called from JS within
+    // the WebView
+    g_signal_connect(web_view, "close",
+            G_CALLBACK(on_close_web_view), wk_context);
+
+    // Use the webview settings we parsed out of argv earlier
+    webkit_web_view_set_settings(web_view, wk_settings);
+
+    // Listen for page load failures, so we can show a custom error page.
+    //
+    // This doesn't fire for HTTP failures; those still get whatever page the
+    // server sends back.  This fires for failures at a level below HTTP, for
+    // when the server can't be found and such.
+    g_signal_connect(web_view, "load-failed",
+            G_CALLBACK(on_page_load_failed), NULL);
+    g_signal_connect(web_view, "load-changed",
+            G_CALLBACK(on_page_load_changed), layer);
+    g_signal_connect(web_view, "web-process-terminated",
+            G_CALLBACK(on_web_process_terminated), layer);
+    if (clickable_alpha)
+        g_signal_connect_after(web_view, "draw",
+                G_CALLBACK(on_web_view_draw), layer);
+
+    // Make transparent
+    GdkRGBA rgba = { .alpha = 0.0 };
+    webkit_web_view_set_background_color(web_view, &rgba);
+
+    //
+    // Set up the JavaScript API
+    //
+
+    // Set up listeners for calls from JavaScript, and the message handlers
+    // on the JavaScript side that make them.
+    for (int i = 0; i < G_N_ELEMENTS(js_calls); ++i) {
+        struct js_call_binding *binding = g_new(struct js_call_binding, 1);
+        binding->layer = layer;
+        binding->call = i;
+        char *signal = g_strconcat("script-message-with-reply-received::",
+                js_calls[i].name, NULL);
+        g_signal_connect_data(manager, signal, G_CALLBACK(on_js_call),
+                binding, (GClosureNotify)g_free, 0);
+        g_free(signal);
+        webkit_user_content_manager_register_script_message_handler_with_reply(
+                manager, js_calls[i].name, NULL);
+    }
+
+    // Set up our Hudkit object to be loaded in the browser JS before anything
+    // else does.  Its functions are wrappers around the appropriate WebKit
+    // message handlers we just set up above.
+    webkit_user_content_manager_add_script(
+            manager,
+            webkit_user_script_new(
+"\n// Everything is wrapped in a function, so none of our variables can clash"
+"\n// with the page's own globals."
+"\n;(() => {"
+"\n  const handlers = window.webkit.messageHandlers"
+"\n  // Clickable areas as x,y,width,height quadruples.  The ones passed to"
+"\n  // `setClickableAreas`, and the ones of elements marked with the"
+"\n  // `data-hudkit-clickable` attribute, are kept separately and sent together."
+"\n  let manualClickableAreas = new Int32Array(0)"
+"\n  let trackedClickableAreas = new Int32Array(0)"
+"\n  const sendClickableAreas = () => {"
+"\n    let rectangles = manualClickableAreas"
+"\n    if (trackedClickableAreas.length > 0) {"
+"\n      rectangles = new Int32Array("
+"\n        manualClickableAreas.length + trackedClickableAreas.length)"
+"\n      rectangles.set(manualClickableAreas)"
+"\n      rectangles.set(trackedClickableAreas, manualClickableAreas.length)"
+"\n    }"
+"\n    return handlers.setClickableAreas.postMessage(rectangles)"
+"\n  }"
+"\n  // Pack rectangle objects into x,y,width,height quadruples, which is what the"
+"\n  // native side reads."
+"\n  const packRectangles = (rectangles) => {"
+"\n    if (rectangles instanceof Int32Array) return rectangles"
+"\n    if (!Array.isArray(rectangles)) {"
+"\n      throw new TypeError("
+"\n        'expected an Array of rectangles, or an Int32Array')"
+"\n    }"
+"\n    const packed = new Int32Array(rectangles.length * 4)"
+"\n    for (let i = 0; i < rectangles.length; ++i) {"
+"\n      const r = rectangles[i]"
+"\n      packed[i * 4]     = r.x"
+"\n      packed[i * 4 + 1] = r.y"
+"\n      packed[i * 4 + 2] = r.width"
+"\n      packed[i * 4 + 3] = r.height"
+"\n    }"
+"\n    return packed"
+"\n  }"
+"\n  window.Hudkit = {"
+"\n    // The native side only queues events that have listeners, so it's told"
+"\n    // when an event gets its first one, or loses its last."
+"\n    on: function (eventName, callback) {"
+"\n      if (window.Hudkit._listeners.has(eventName)) {"
+"\n        window.Hudkit._listeners.get(eventName).push(callback)"
+"\n      } else {"
+"\n        window.Hudkit._listeners.set(eventName, [callback])"
+"\n        handlers._subscribe.postMessage([eventName, true])"
+"\n          .catch(console.error)"
+"\n      }"
+"\n    },"
+"\n    off: function (eventName, callback) {"
+"\n      const listenersForThisEvent = window.Hudkit._listeners.get(eventName)"
+"\n      if (!listenersForThisEvent) return"
+"\n      const index = listenersForThisEvent.indexOf(callback)"
+"\n      if (index === -1) return"
+"\n      listenersForThisEvent.splice(index, 1)"
+"\n      if (listenersForThisEvent.length === 0) {"
+"\n        window.Hudkit._listeners.delete(eventName)"
+"\n        handlers._subscribe.postMessage([eventName, false])"
+"\n          .catch(console.error)"
+"\n      }"
+"\n    },"
+"\n    getMonitorLayout: async function () {"
+"\n      return handlers.getMonitorLayout.postMessage(null)"
+"\n    },"
+"\n    getWindowGeometry: async function () {"
+"\n      return handlers.getWindowGeometry.postMessage(null)"
+"\n    },"
+"\n    setClickableAreas: async function (rectangles) {"
+"\n      manualClickableAreas = packRectangles(rectangles)"
+"\n      return sendClickableAreas()"
+"\n    },"
+"\n    setPaintedAreas: async function (rectangles) {"
+"\n      return handlers.setPaintedAreas.postMessage("
+"\n        rectangles === null ? null : packRectangles(rectangles))"
+"\n    },"
+"\n    getFrameStats: async function (reset) {"
+"\n      return handlers.getFrameStats.postMessage(reset ? true : false)"
+"\n    },"
+"\n    getStats: async function () {"
+"\n      return handlers.getStats.postMessage(null)"
+"\n    },"
+"\n    setFrameRateLimit: async function (fps) {"
+"\n      return handlers.setFrameRateLimit.postMessage(fps)"
+"\n    },"
+"\n    showInspector: async function (shouldAttachToWindow) {"
+"\n      shouldAttachToWindow = shouldAttachToWindow ? true : false"
+"\n      return handlers.showInspector.postMessage(shouldAttachToWindow)"
+"\n    },"
+"\n  }"
+"\n  Object.defineProperty(window.Hudkit, '_listeners', {"
+"\n    value: new Map(),"
+"\n    enumerable: false,"
+"\n    configurable: false,"
+"\n    writable: true,"
+"\n  })"
+"\n  // Events arrive in batches, at most one per frame, as the answer to a"
+"\n  // request we always keep outstanding.  Each batch is a flat Array of"
+"\n  // alternating event names and data."
+"\n  const dispatchEvents = (batch) => {"
+"\n    for (let i = 0; i < batch.length; i += 2) {"
+"\n      const listeners = window.Hudkit._listeners.get(batch[i])"
+"\n      if (!listeners) continue"
+"\n      // Copied, so listeners can remove themselves."
+"\n      for (const listener of [...listeners]) {"
+"\n        try {"
+"\n          listener(batch[i + 1])"
+"\n        } catch (e) {"
+"\n          console.error(e)"
+"\n        }"
+"\n      }"
+"\n    }"
+"\n  }"
+"\n  const requestEvents = () => {"
+"\n    handlers._events.postMessage(null).then((batch) => {"
+"\n      requestEvents()"
+"\n      dispatchEvents(batch)"
+"\n    }, console.error)"
+"\n  }"
+"\n  requestEvents()"
+"\n  // Throttle requestAnimationFrame callbacks to the frame rate limit the"
+"\n  // native side tells us.  Callbacks are collected, and all run together on"
+"\n  // the first real animation frame that's at least one frame interval after"
+"\n  // the last one that ran them."
+"\n  ;(() => {"
+"\n    const realRequestAnimationFrame = window.requestAnimationFrame.bind(window)"
+"\n    let minFrameInterval = 0"
+"\n    let lastFrameTime = -Infinity"
+"\n    let callbacks = new Map()"
+"\n    let nextId = 1"
+"\n    let frameRequested = false"
+"\n    const onFrame = (time) => {"
+"\n      frameRequested = false"
+"\n      // A little slack, since real frames don't arrive exactly on time."
+"\n      if (time - lastFrameTime < minFrameInterval - 2) {"
+"\n        requestFrame()"
+"\n        return"
+"\n      }"
+"\n      lastFrameTime = time"
+"\n      const callbacksThisFrame = callbacks"
+"\n      callbacks = new Map()"
+"\n      for (const callback of callbacksThisFrame.values()) {"
+"\n        try {"
+"\n          callback(time)"
+"\n        } catch (e) {"
+"\n          console.error(e)"
+"\n        }"
+"\n      }"
+"\n    }"
+"\n    const requestFrame = () => {"
+"\n      if (frameRequested) return"
+"\n      frameRequested = true"
+"\n      realRequestAnimationFrame(onFrame)"
+"\n    }"
+"\n    window.requestAnimationFrame = (callback) => {"
+"\n      const id = nextId++"
+"\n      callbacks.set(id, callback)"
+"\n      requestFrame()"
+"\n      return id"
+"\n    }"
+"\n    window.cancelAnimationFrame = (id) => { callbacks.delete(id) }"
+"\n    window.Hudkit.on('frame-rate-limit', (fps) => {"
+"\n      minFrameInterval = fps > 0 ? 1000 / fps : 0"
+"\n    })"
+"\n  })()"
+"\n  // Keep elements marked with the `data-hudkit-clickable` attribute clickable,"
+"\n  // wherever they are.  Anything that might move or resize them schedules a"
+"\n  // recheck on the next animation frame, so there's at most one per frame, and"
+"\n  // the result is only sent if it's different from last time."
+"\n  ;(() => {"
+"\n    let recheckScheduled = false"
+"\n    const observedElements = new Set()"
+"\n    const scheduleRecheck = () => {"
+"\n      if (recheckScheduled) return"
+"\n      recheckScheduled = true"
+"\n      requestAnimationFrame(recheck)"
+"\n    }"
+"\n    const resizeObserver = new ResizeObserver(scheduleRecheck)"
+"\n    const recheck = () => {"
+"\n      recheckScheduled = false"
+"\n      const elements = document.querySelectorAll('[data-hudkit-clickable]')"
+"\n"
+"\n      // Stop observing elements that are gone before anything else, so"
+"\n      // they aren't kept alive, even if nothing is clickable anymore."
+"\n      const stillPresent = new Set(elements)"
+"\n      for (const element of observedElements) {"
+"\n        if (!stillPresent.has(element)) {"
+"\n          resizeObserver.unobserve(element)"
+"\n          observedElements.delete(element)"
+"\n        }"
+"\n      }"
+"\n      if (elements.length === 0 && trackedClickableAreas.length === 0) return"
+"\n"
+"\n      const areas = new Int32Array(elements.length * 4)"
+"\n      let length = 0"
+"\n      for (const element of elements) {"
+"\n        if (!observedElements.has(element)) {"
+"\n          resizeObserver.observe(element)"
+"\n          observedElements.add(element)"
+"\n        }"
+"\n        const r = element.getBoundingClientRect()"
+"\n        if (r.width <= 0 || r.height <= 0) continue"
+"\n        const left = Math.floor(r.left)"
+"\n        const top = Math.floor(r.top)"
+"\n        areas[length++] = left"
+"\n        areas[length++] = top"
+"\n        areas[length++] = Math.ceil(r.right) - left"
+"\n        areas[length++] = Math.ceil(r.bottom) - top"
+"\n      }"
+"\n"
+"\n      const unchanged = length === trackedClickableAreas.length &&"
+"\n        areas.subarray(0, length).every((v, i) => v === trackedClickableAreas[i])"
+"\n      if (unchanged) return"
+"\n      trackedClickableAreas = areas.slice(0, length)"
+"\n      sendClickableAreas().catch(console.error)"
+"\n    }"
+"\n    new MutationObserver(scheduleRecheck).observe(document,"
+"\n      { subtree: true, childList: true, attributes: true })"
+"\n    for (const eventName of ['resize', 'scroll', 'load',"
+"\n                             'transitionend', 'animationend']) {"
+"\n      window.addEventListener(eventName, scheduleRecheck,"
+"\n        { capture: true, passive: true })"
+"\n    }"
+"\n    // Monitor changes reset the clickable areas natively, so forget the manual"
+"\n    // ones too, and re-send the tracked ones."
+"\n    window.Hudkit.on('monitors-changed', () => {"
+"\n      manualClickableAreas = new Int32Array(0)"
+"\n      trackedClickableAreas = new Int32Array(0)"
+"\n      scheduleRecheck()"
+"\n    })"
+"\n  })()"
+"\n})()",
+                WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+                WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+                NULL, NULL));
+
+    // Initialise inspector, and start tracking when it's attached to or
+    // detached from the overlay window.
+    layer->inspector = webkit_web_view_get_inspector(web_view);
+    g_signal_connect(layer->inspector, "attach",
+            G_CALLBACK(on_inspector_attach), layer);
+    g_signal_connect(layer->inspector, "detach",
+            G_CALLBACK(on_inspector_detach), layer);
+
+    // Start loading the page now.  The window setup in `overlay_new` doesn't
+    // need the page, so it happens while the web process works on loading it.
+    webkit_web_view_load_uri(web_view, url);
+    startup_trace("load started (%s)", url);
+
+    g_ptr_array_add(overlay->layers, layer);
+    return layer;
+}
+
+// Frees a layer, once the window its web view was in is gone.
+static void layer_free(struct layer *layer) {
+    if (layer->restart_id) g_source_remove(layer->restart_id);
+    g_array_free(layer->user_defined_input_rects, TRUE);
+    if (layer->applied_input_shape)
+        cairo_region_destroy(layer->applied_input_shape);
+    g_array_free(layer->painted_rects, TRUE);
+    if (layer->detected_painted_region)
+        cairo_region_destroy(layer->detected_painted_region);
+    alpha_mask_clear(&layer->alpha_mask);
+    g_free(layer);
+}
+
+// Creates an overlay window covering the given monitor (or all of them, if
+// `monitor` is NULL), with a layer inside it for each target URL.
+struct overlay *overlay_new(GdkMonitor *monitor) {
+    struct overlay *overlay = g_new0(struct overlay, 1);
+    overlay->monitor = monitor ? g_object_ref(monitor) : NULL;
+
+    overlay->layers = g_ptr_array_new();
+
+    //
+    // Set up a layer for each page
+    //
+
+    for (int i = 0; i < target_urls->len; ++i) {
+        WebKitWebView *related_view = i > 0
+            ? ((struct layer *)g_ptr_array_index(overlay->layers, 0))->web_view
+            : NULL;
+        layer_new(overlay, g_ptr_array_index(target_urls, i), related_view);
+    }
+
+    //
+    // Create the window
+    //
+
+    // Create the window that will become our overlay.  Headless, it's drawn
+    // only into memory, and never shown on screen.
+    GtkWidget *window = headless_monitors
+        ? gtk_offscreen_window_new() : gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    if (headless_monitors)
+        g_signal_connect_after(window, "draw",
+                G_CALLBACK(on_headless_window_draw), overlay);
+    overlay->window = window;
+    gtk_window_set_gravity(GTK_WINDOW(window), GDK_GRAVITY_NORTH_WEST);
+    gtk_window_move(GTK_WINDOW(window), 0, 0);
+    gtk_window_set_title(GTK_WINDOW(window), "hudkit overlay window");
+    g_signal_connect(G_OBJECT(window), "delete-event", gtk_main_quit, NULL);
+    gtk_widget_set_app_paintable(window, TRUE);
+
+    // Set up a callback to react to screen changes
+    g_signal_connect(window, "screen-changed",
+            G_CALLBACK(screen_changed), overlay);
+    // Set up a callback to react to screen compositing changes
+    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
+    overlay->composited_changed_handler_id =
+        g_signal_connect(screen, "composited-changed",
+                G_CALLBACK(composited_changed), overlay);
+
+    // Stack the layers' web views.  The bottom one is the GtkOverlay's main
+    // child, which it sizes itself to; the others are overlaid on it, filling
+    // the same area.  Those are pass-through, so whatever part of them isn't
+    // in their web view's input shape lets clicks go to the layers below.
+    overlay->stack = gtk_overlay_new();
+    for (int i = 0; i < overlay->layers->len; ++i) {
+        struct layer *layer = g_ptr_array_index(overlay->layers, i);
+        GtkWidget *web_view = GTK_WIDGET(layer->web_view);
+        if (i == 0) {
+            gtk_container_add(GTK_CONTAINER(overlay->stack), web_view);
+        } else {
+            gtk_overlay_add_overlay(GTK_OVERLAY(overlay->stack), web_view);
+            gtk_overlay_set_overlay_pass_through(GTK_OVERLAY(overlay->stack),
+                    web_view, TRUE);
+        }
+    }
+    gtk_container_add(GTK_CONTAINER(window), overlay->stack);
+
+    //
+    // Position the overlay window, and make it input-transparent
+    //
+
+    // Set the window up for the screen it's on.  This also sizes it to the
+    // monitor layout.
+    screen_changed(window, NULL, overlay);
+
+    // Create the window on the X server, but don't show it yet, so we can
+    // get our properties ready before the window manager ever sees it.
+    gtk_widget_realize(window);
+    GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(window));
+
+    // "Can't touch this!" - to the window manager
+    //
+    // The override-redirect flag prevents the window manager taking control of
+    // the window, so it remains in our control.  (Headless, there's no window
+    // manager to keep out.)
+    if (!headless_monitors)
+        gdk_window_set_override_redirect(GDK_WINDOW(gdk_window), true);
+    // But just in case, light up the flags like a Christmas tree, with all the
+    // WM hints we can think of to try to convince whatever that's reading them
+    // (probably a window manager) to keep this window on-top and fullscreen
+    // but otherwise leave it alone.
+    gtk_window_set_keep_above       (GTK_WINDOW(window), true);
+    gtk_window_set_skip_taskbar_hint(GTK_WINDOW(window), true);
+    gtk_window_set_skip_pager_hint  (GTK_WINDOW(window), true);
+    gtk_window_set_focus_on_map     (GTK_WINDOW(window), false);
+    gtk_window_set_accept_focus     (GTK_WINDOW(window), true);
+    gtk_window_set_decorated        (GTK_WINDOW(window), false);
+    gtk_window_set_resizable        (GTK_WINDOW(window), false);
+
+    // "Can't touch this!" - to user actions
+    //
+    // Set the input shape (area where clicks are recognised) to a zero-width,
+    // zero-height region a.k.a. nothing.  This makes clicks pass through the
+    // window onto whatever's below.
+    realize_input_shape(overlay);
+
+    // Now show the window, once.  It's click-through, and since it was
+    // override-redirect from the start, no window manager gets to move it,
+    // so it's in the right place from its first frame.
+    gtk_widget_show_all(window);
+    startup_trace("window shown");
+    // The layers' web views only got their own GDK windows just now, so
+    // their input shapes couldn't be set until now.
+    if (overlay->layers->len > 1) queue_input_shape(overlay);
+
+    // The window has its frame clock now that it's realized, so we can start
+    // timing frames.
+    frame_stats_connect(overlay);
+    frame_export_start(overlay);
+
+    g_ptr_array_add(overlays, overlay);
+    // It might already be covered.
+    schedule_visibility_update();
+    return overlay;
 }
-bool on_inspector_detach(WebKitWebInspector *inspector, gpointer user_data) {
-    // When the web inspector detaches from the overlay window, stop tracking
-    // its position, and zero out its input shape rectangle.
 
-    WebKitWebViewBase *inspector_web_view = webkit_web_inspector_get_web_view(
-            inspector);
-    if (inspector_size_allocate_handler_id)
-        g_signal_handler_disconnect(GTK_WIDGET(inspector_web_view),
-                inspector_size_allocate_handler_id);
-    inspector_size_allocate_handler_id = 0;
-    attached_inspector_input_rect.x = 0;
-    attached_inspector_input_rect.y = 0;
-    attached_inspector_input_rect.width = 0;
-    attached_inspector_input_rect.height = 0;
-    realize_input_shape();
-    return FALSE; // Allow detach
+// Tears down an overlay, such as when its monitor has been unplugged.
+void overlay_destroy(struct overlay *overlay) {
+    g_ptr_array_remove(overlays, overlay);
+
+    GdkScreen *screen = gtk_widget_get_screen(overlay->window);
+    g_signal_handler_disconnect(screen, overlay->composited_changed_handler_id);
+    if (overlay->input_shape_tick_id)
+        gtk_widget_remove_tick_callback(overlay->window,
+                overlay->input_shape_tick_id);
+    if (overlay->frame_event_tick_id)
+        gtk_widget_remove_tick_callback(overlay->window,
+                overlay->frame_event_tick_id);
+    for (int i = 0; i < overlay->layers->len; ++i)
+        event_queue_clear(g_ptr_array_index(overlay->layers, i));
+    frame_stats_disconnect(overlay);
+    frame_export_stop(overlay);
+    // Destroying the window destroys the web views inside it too.
+    gtk_widget_destroy(overlay->window);
+    for (int i = 0; i < overlay->layers->len; ++i)
+        layer_free(g_ptr_array_index(overlay->layers, i));
+    g_ptr_array_free(overlay->layers, TRUE);
+    // Its pages might've been the last ones listening for metrics or input.
+    update_metrics_sampler();
+    update_input_events();
+
+    if (overlay->applied_input_shape)
+        cairo_region_destroy(overlay->applied_input_shape);
+    if (overlay->applied_bounding_shape)
+        cairo_region_destroy(overlay->applied_bounding_shape);
+    if (overlay->monitor) g_object_unref(overlay->monitor);
+    g_free(overlay);
 }
 
-bool on_page_load_failed(WebKitWebView *web_view, WebKitLoadEvent load_event,
-        gchar *failing_uri, GError *error, gpointer user_data) {
-    // Show a custom error page
-    char page_content[2000];
-    snprintf(page_content, sizeof(page_content), "\
-<html>\n\
-<head>\n\
-<style>\n\
-    body { background : rgba(255,0,0,0.2) }\n\
-    h1 { color : white; filter: drop-shadow(0 0 0.75rem black); }\n\
-</style>\n\
-</head>\n\
-<h1>%s<br>%s</h1>\n\
-</html>", error->message, failing_uri);
-    // `failing_uri` is URL-escaped, so it's fine to inject.
-    // TODO URI-escape the error message for maximum paranoia?
-    webkit_web_view_load_alternate_html(
-            web_view, page_content, failing_uri, NULL);
+// Makes sure there's exactly one overlay for each monitor currently
+// connected: creates ones for new monitors, destroys ones whose monitor has
+// gone away.  Only used with --per-monitor.
+//
+// Returns how many overlays were created.  They're the ones at the end of
+// `overlays`.
+static int sync_per_monitor_overlays(GdkDisplay *display) {
+    int n = gdk_display_get_n_monitors(display);
+    int n_created = 0;
+
+    // Iterate backwards, since we may remove entries as we go.
+    for (int i = overlays->len - 1; i >= 0; --i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        bool still_connected = FALSE;
+        for (int j = 0; j < n; ++j) {
+            if (gdk_display_get_monitor(display, j) == overlay->monitor) {
+                still_connected = TRUE;
+                break;
+            }
+        }
+        if (!still_connected) overlay_destroy(overlay);
+    }
 
-    // Don't call other handlers
-    return FALSE;
+    for (int j = 0; j < n; ++j) {
+        GdkMonitor *monitor = gdk_display_get_monitor(display, j);
+        bool has_overlay = FALSE;
+        for (int i = 0; i < overlays->len; ++i) {
+            struct overlay *overlay = g_ptr_array_index(overlays, i);
+            if (overlay->monitor == monitor) {
+                has_overlay = TRUE;
+                break;
+            }
+        }
+        if (!has_overlay) {
+            overlay_new(monitor);
+            ++n_created;
+        }
+    }
+    return n_created;
 }
 
-void printUsage(char *programName) {
-    printf(
-"USAGE: %s <URL> [--help] [--webkit-settings option1=value1,...]"
-"\n"
-"\n    <URL>"
-"\n        Universal Resource Locator to be loaded on the overlay web view."
-"\n        For example, to load a local file, you'd pass something like:"
-"\n"
-"\n            file:///home/mary/test.html"
-"\n"
-"\n        or to load from a local web server at port 4000:"
-"\n"
-"\n            http://localhost:4000"
-"\n"
-"\n    --inspect"
-"\n        Open the Web Inspector (dev tools) on start."
-"\n"
-"\n    --webkit-settings <settings>"
-"\n        The <settings> should be a comma-separated list of settings."
-"\n"
-"\n        Boolean settings can look like"
-"\n            option-name"
-"\n            option-name=TRUE"
-"\n            option-name=FALSE"
-"\n"
-"\n        String, integer, and enum options look like"
-"\n            option-name=foo"
-"\n            option-name=42"
-"\n"
-"\n        To see settings available on your system's WebKit version, their"
-"\n        valid values, and default values, pass '--webkit-settings help'."
-"\n"
-"\n        To see explanations of the settings, see"
-"\n        https://webkitgtk.org/reference/webkit2gtk/stable/WebKitSettings.html"
-"\n"
-"\n    --help"
-"\n        Print this help text, then exit."
-"\n"
-"\n    All of the standard GTK debug options and env variables are also"
-"\n    supported.  You probably won't need them, but you can find a list here:"
-"\n    https://developer.gnome.org/gtk3/stable/gtk-running.html"
-"\n",
-        programName);
+// Returns the value following the option at argv[*i], as a number, and moves
+// *i past it.  Exits if it's missing or isn't a non-negative number.
+static double parse_number_option(int argc, char **argv, int *i) {
+    char *option = argv[*i];
+    if (++*i >= argc) {
+        fprintf(stderr, "Missing value for %s\n", option);
+        exit(6);
+    }
+    char *end;
+    double value = strtod(argv[*i], &end);
+    if (end == argv[*i] || *end != '\0' || !(value >= 0)) {
+        fprintf(stderr, "Invalid value for %s: %s ", option, argv[*i]);
+        fprintf(stderr, "(expected a non-negative number)\n");
+        exit(6);
+    }
+    return value;
 }
 
 int main(int argc, char **argv) {
+    startup_time = g_get_monotonic_time();
+    // Tracing has to be on before we can parse the rest of the options.
+    for (int i = 1; i < argc; ++i)
+        if (!strcmp(argv[i], "--startup-trace")) startup_trace_enabled = TRUE;
+    if (startup_trace_enabled) startup_trace_exec();
+    startup_trace("main");
+
+    // Making a bundle is all --make-bundle does, so it doesn't need a display,
+    // and happens before GTK wants one.
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--make-bundle")) continue;
+        if (i + 2 >= argc) {
+            fprintf(stderr, "--make-bundle needs a directory and an output file\n");
+            exit(6);
+        }
+        make_bundle(argv[i + 1], argv[i + 2]);
+    }
 
     gtk_init(&argc, &argv);
+    startup_trace("gtk_init done");
 
     //
     // Parse command line options
     //
 
+    target_urls = g_ptr_array_new();
+
     // Turn on some WebKit settings by default:
-    WebKitSettings *wk_settings = webkit_settings_new();
+    wk_settings = webkit_settings_new();
     // Allow using web inspector
     webkit_settings_set_enable_developer_extras(wk_settings, TRUE);
     // Console logs are shown on stdout
     webkit_settings_set_enable_write_console_messages_to_stdout(wk_settings, TRUE);
 
-    char *target_url = NULL;
     bool open_inspector_immediately = FALSE;
+    bundle_headers = g_ptr_array_new();
 
     for (int i = 1; i < argc; ++i) {
         // Handle flag arguments
         if      (!strcmp(argv[i], "--help")) { printUsage(argv[0]); exit(0); }
         else if (!strcmp(argv[i], "--inspect")) open_inspector_immediately = TRUE;
+        else if (!strcmp(argv[i], "--per-monitor")) per_monitor_windows = TRUE;
+        else if (!strcmp(argv[i], "--startup-trace")) continue; // done already
+        else if (!strcmp(argv[i], "--max-fps"))
+            max_fps = parse_number_option(argc, argv, &i);
+        else if (!strcmp(argv[i], "--cpu-budget"))
+            cpu_budget_percent = parse_number_option(argc, argv, &i);
+        else if (!strcmp(argv[i], "--frame-stats-file")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --frame-stats-file\n");
+                exit(6);
+            }
+            frame_stats_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "--cache-dir")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --cache-dir\n");
+                exit(6);
+            }
+            cache_dir = argv[i];
+        }
+        else if (!strcmp(argv[i], "--cache-model")) {
+            GEnumClass *enum_class = g_type_class_ref(WEBKIT_TYPE_CACHE_MODEL);
+            GEnumValue *value = ++i < argc
+                ? g_enum_get_value_by_nick(enum_class, argv[i]) : NULL;
+            if (!value) {
+                fprintf(stderr, "Invalid value for --cache-model ");
+                fprintf(stderr, "(expected one of:");
+                for (int j = 0; j < enum_class->n_values; ++j)
+                    fprintf(stderr, " %s", enum_class->values[j].value_nick);
+                fprintf(stderr, ")\n");
+                exit(6);
+            }
+            cache_model = value->value;
+            g_type_class_unref(enum_class);
+        }
+        else if (!strcmp(argv[i], "--bundle")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --bundle\n");
+                exit(6);
+            }
+            bundle_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--bundle-header")) {
+            if (++i >= argc || !strchr(argv[i], ':')) {
+                fprintf(stderr, "Invalid value for --bundle-header ");
+                fprintf(stderr, "(expected 'Name: value')\n");
+                exit(6);
+            }
+            g_ptr_array_add(bundle_headers, argv[i]);
+        }
+        else if (!strcmp(argv[i], "--clickable-alpha")) {
+            double value = parse_number_option(argc, argv, &i);
+            if (value < 1 || value > 255) {
+                fprintf(stderr, "Invalid value for --clickable-alpha: %s ",
+                        argv[i]);
+                fprintf(stderr, "(expected 1 to 255)\n");
+                exit(6);
+            }
+            clickable_alpha = value;
+        }
+        else if (!strcmp(argv[i], "--watch")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --watch\n");
+                exit(6);
+            }
+            if (!g_file_test(argv[i], G_FILE_TEST_IS_DIR)) {
+                fprintf(stderr, "Invalid value for --watch: %s ", argv[i]);
+                fprintf(stderr, "(expected a directory)\n");
+                exit(6);
+            }
+            watch_dir = argv[i];
+        }
+        else if (!strcmp(argv[i], "--input-events")) {
+            input_events_enabled = TRUE;
+        }
+        else if (!strcmp(argv[i], "--shape-to-painted")) {
+            shape_to_painted = TRUE;
+        }
+        else if (!strcmp(argv[i], "--memory-limit")) {
+            memory_limit_mib = parse_number_option(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--metrics-interval")) {
+            metrics_interval_ms = parse_number_option(argc, argv, &i);
+            if (metrics_interval_ms < MIN_METRICS_INTERVAL_MS)
+                metrics_interval_ms = MIN_METRICS_INTERVAL_MS;
+        }
+        else if (!strcmp(argv[i], "--data-socket")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --data-socket\n");
+                exit(6);
+            }
+            data_socket_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--data-fifo")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --data-fifo\n");
+                exit(6);
+            }
+            data_fifo_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--data-framing")) {
+            ++i;
+            if (i < argc && !strcmp(argv[i], "lines"))
+                data_framing = DATA_FRAMING_LINES;
+            else if (i < argc && !strcmp(argv[i], "length"))
+                data_framing = DATA_FRAMING_LENGTH;
+            else {
+                fprintf(stderr, "Invalid value for --data-framing ");
+                fprintf(stderr, "(expected lines or length)\n");
+                exit(6);
+            }
+        }
+        else if (!strcmp(argv[i], "--headless")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --headless\n");
+                exit(6);
+            }
+            headless_monitors = parse_monitor_layout(argv[i]);
+            if (!headless_monitors) {
+                fprintf(stderr, "Invalid value for --headless: %s ", argv[i]);
+                fprintf(stderr, "(expected a layout like "
+                        "1920x1080,1280x1024+1920+0)\n");
+                exit(6);
+            }
+        }
+        else if (!strcmp(argv[i], "--headless-checksums")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --headless-checksums\n");
+                exit(6);
+            }
+            headless_checksums_file = fopen(argv[i], "w");
+            if (!headless_checksums_file) {
+                fprintf(stderr, "Can't open --headless-checksums %s: %s\n",
+                        argv[i], g_strerror(errno));
+                exit(9);
+            }
+        }
+        else if (!strcmp(argv[i], "--headless-png")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --headless-png\n");
+                exit(6);
+            }
+            headless_png_dir = argv[i];
+            if (g_mkdir_with_parents(headless_png_dir, 0755) != 0) {
+                fprintf(stderr, "Can't create --headless-png %s: %s\n",
+                        headless_png_dir, g_strerror(errno));
+                exit(9);
+            }
+        }
+        else if (!strcmp(argv[i], "--headless-frames")) {
+            double value = parse_number_option(argc, argv, &i);
+            if (value < 1) {
+                fprintf(stderr, "Invalid value for --headless-frames: %s ",
+                        argv[i]);
+                fprintf(stderr, "(expected at least 1)\n");
+                exit(6);
+            }
+            headless_frame_limit = value;
+        }
+        else if (!strcmp(argv[i], "--export-frames")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --export-frames\n");
+                exit(6);
+            }
+            // What shm_open accepts portably.
+            if (argv[i][0] != '/' || strchr(argv[i] + 1, '/')) {
+                fprintf(stderr, "Invalid value for --export-frames: %s ",
+                        argv[i]);
+                fprintf(stderr, "(expected a name like /hudkit)\n");
+                exit(6);
+            }
+            export_frames_name = argv[i];
+        }
+        else if (!strcmp(argv[i], "--stats-file")) {
+            if (++i >= argc) {
+                fprintf(stderr, "Missing value for --stats-file\n");
+                exit(6);
+            }
+            stats_file = argv[i];
+        }
         else if (!strcmp(argv[i], "--webkit-settings")) {
 
             // Fetch all the WebKitSettings object's properties, so we can
@@ -642,87 +5595,112 @@ next:
             free(setting_properties);
         }
         else {
-            // Handle positional arguments.  Should be only 1: the target URL.
-            if (!target_url) {
-                target_url = argv[i];
-            } else {
-                fprintf(stderr, "Too many positional arguments!\n\n");
-                printUsage(argv[0]);
-                exit(1);
-            }
+            // Handle positional arguments.  They're the target URLs, one
+            // per layer, bottom first.
+            g_ptr_array_add(target_urls, argv[i]);
         }
     }
 
-    if (target_url == NULL) {
+    // A bundle's index.html is a sensible default.
+    if (target_urls->len == 0 && bundle_path)
+        g_ptr_array_add(target_urls, "hudkit://bundle/");
+
+    if (target_urls->len == 0) {
         fprintf(stderr, "No target URL specified!\n\n");
         printUsage(argv[0]);
         exit(2);
     }
+    if (per_monitor_windows && headless_monitors) {
+        fprintf(stderr, "--per-monitor can't be used with --headless\n");
+        exit(6);
+    }
+    if (!headless_monitors && (headless_checksums_file || headless_png_dir
+                || headless_frame_limit)) {
+        fprintf(stderr, "--headless-checksums, --headless-png and "
+                "--headless-frames only work with --headless\n");
+        exit(6);
+    }
+    startup_trace("options parsed");
+
+    // This only affects web processes started after it's set, so it has to
+    // come before any web context exists.
+    if (memory_limit_mib > 0) {
+        WebKitMemoryPressureSettings *memory_settings =
+            webkit_memory_pressure_settings_new();
+        webkit_memory_pressure_settings_set_memory_limit(memory_settings,
+                MAX(1, (guint)memory_limit_mib));
+        webkit_web_context_set_memory_pressure_settings(memory_settings);
+        webkit_memory_pressure_settings_free(memory_settings);
+    }
 
-    // Initialise the array of user-JS-defined clickable areas to empty
-    user_defined_input_rects = g_array_new(
-            FALSE, // don't NULL-terminate
-            TRUE,  // zero memory
-            sizeof(cairo_rectangle_int_t));
-
-    //
-    // Create the window
-    //
-
-    // Create the window that will become our overlay
-    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_gravity(GTK_WINDOW(window), GDK_GRAVITY_NORTH_WEST);
-    gtk_window_move(GTK_WINDOW(window), 0, 0);
-    gtk_window_set_title(GTK_WINDOW(window), "hudkit overlay window");
-    g_signal_connect(G_OBJECT(window), "delete-event", gtk_main_quit, NULL);
-    gtk_widget_set_app_paintable(window, TRUE);
-
-    //
-    // Set up the WebKit web view widget
-    //
-
-    // Disable caching
-    WebKitWebContext *wk_context = webkit_web_context_get_default();
-    webkit_web_context_set_cache_model(wk_context,
-            WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(
-            webkit_web_view_new_with_context(wk_context));
-
-    // Set up a callback to react to screen changes
-    g_signal_connect(window, "screen-changed",
-            G_CALLBACK(screen_changed), web_view);
-    // Set up a callback to react to screen compositing changes
-    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
-    g_signal_connect(screen, "composited-changed",
-            G_CALLBACK(composited_changed), web_view);
-
-    // Set up a callback to react to window.close() being called from JS within
-    // the WebView
-    g_signal_connect(web_view, "close",
-            G_CALLBACK(on_close_web_view), wk_context);
+    if (cache_dir) {
+        // Keep the network cache (including compiled JavaScript bytecode,
+        // which WebKit stores alongside the scripts) and other website data
+        // on disk, so restarts don't fetch and parse everything again.
+        char *data_dir = g_build_filename(cache_dir, "data", NULL);
+        WebKitWebsiteDataManager *data_manager =
+            webkit_website_data_manager_new(
+                    "base-cache-directory", cache_dir,
+                    "base-data-directory", data_dir,
+                    NULL);
+        g_free(data_dir);
+        wk_context = webkit_web_context_new_with_website_data_manager(
+                data_manager);
+        g_object_unref(data_manager);
+    } else {
+        wk_context = webkit_web_context_get_default();
+    }
+    // Without a --cache-dir, caching is disabled by default, since there's
+    // nowhere persistent to keep it anyway.
+    webkit_web_context_set_cache_model(wk_context, cache_model != -1
+            ? cache_model
+            : cache_dir ? WEBKIT_CACHE_MODEL_WEB_BROWSER
+                        : WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+
+    if (bundle_path) {
+        open_bundle();
+        register_hudkit_scheme(wk_context);
+    }
 
-    // Use the webview settings we parsed out of argv earlier
-    webkit_web_view_set_settings(web_view, wk_settings);
+    // Start a web process now, so it's starting up while we do everything
+    // else, rather than only once the first web view asks for one.
+    webkit_web_context_prewarm(wk_context);
+    startup_trace("web context ready, web process prewarmed");
 
-    // Listen for page load failures, so we can show a custom error page.
-    //
-    // This doesn't fire for HTTP failures; those still get whatever page the
-    // server sends back.  This fires for failures at a level below HTTP, for
-    // when the server can't be found and such.
-    g_signal_connect(web_view, "load-failed",
-            G_CALLBACK(on_page_load_failed), NULL);
+    overlays = g_ptr_array_new();
+    native_js_context = jsc_context_new();
+    update_monitor_layout(gdk_display_get_default(), NULL);
+    startup_trace("monitor layout read");
 
-    // Initialise inspector, and start tracking when it's attached to or
-    // detached from the overlay window.
-    inspector = webkit_web_view_get_inspector(
-            WEBKIT_WEB_VIEW(web_view));
-    g_signal_connect(inspector, "attach",
-            G_CALLBACK(on_inspector_attach), web_view);
-    g_signal_connect(inspector, "detach",
-            G_CALLBACK(on_inspector_detach), NULL);
+    if (per_monitor_windows) {
+        sync_per_monitor_overlays(gdk_display_get_default());
+    } else {
+        overlay_new(NULL);
+    }
+    startup_trace("overlays created");
+    if (!headless_monitors)
+        start_visibility_tracking(gdk_display_get_default());
+    if (input_events_enabled) start_input_events(gdk_display_get_default());
+    if (watch_dir) start_watching();
+
+    if (cpu_budget_percent > 0)
+        g_timeout_add(CPU_SAMPLE_INTERVAL_MS, on_cpu_sample, NULL);
+    if (memory_limit_mib > 0)
+        g_timeout_add(MEMORY_SAMPLE_INTERVAL_MS, on_memory_sample, NULL);
+    if (shape_to_painted)
+        g_timeout_add(PAINT_ANALYSIS_INTERVAL_MS, on_paint_analysis, NULL);
+    if (frame_stats_file)
+        g_timeout_add_seconds(FRAME_STATS_DUMP_INTERVAL_S,
+                on_frame_stats_dump, NULL);
+    if (stats_file)
+        g_timeout_add_seconds(STATS_DUMP_INTERVAL_S, on_stats_dump, NULL);
+    if (export_frames_name) atexit(remove_exported_frames);
+    if (data_socket_path) open_data_socket();
+    if (data_fifo_path) open_data_fifo();
 
     if (open_inspector_immediately) {
-        show_inspector(FALSE);
+        struct overlay *overlay = g_ptr_array_index(overlays, 0);
+        show_inspector(g_ptr_array_index(overlay->layers, 0), FALSE);
     }
 
     struct sigaction usr1_action = {
@@ -730,254 +5708,125 @@ next:
     };
     sigaction(SIGUSR1, &usr1_action, NULL);
 
-    // Make transparent
-    GdkRGBA rgba = { .alpha = 0.0 };
-    webkit_web_view_set_background_color(web_view, &rgba);
-    gtk_container_add(GTK_CONTAINER(window), GTK_WIDGET(web_view));
-
-    // Load the given URL
-    webkit_web_view_load_uri(web_view, target_url);
-
-    //
-    // Position the overlay window, and make it input-transparent
-    //
-
-    // Initialise the window and make it active.  We need this so it can resize
-    // it correctly.
-    screen_changed(window, NULL, web_view);
-
-    GdkDisplay *display = gdk_display_get_default();
-    GdkRectangle *rectangles = NULL;
-    int nRectangles = get_monitor_rects(display, &rectangles);
-
-    gtk_widget_show_all(window);
-
-    // Hide the window, so we can get our properties ready without the window
-    // manager trying to mess with us.
-    GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(window));
-    gdk_window_hide(GDK_WINDOW(gdk_window));
-
-    // "Can't touch this!" - to the window manager
-    //
-    // The override-redirect flag prevents the window manager taking control of
-    // the window, so it remains in our control.
-    gdk_window_set_override_redirect(GDK_WINDOW(gdk_window), true);
-    // But just in case, light up the flags like a Christmas tree, with all the
-    // WM hints we can think of to try to convince whatever that's reading them
-    // (probably a window manager) to keep this window on-top and fullscreen
-    // but otherwise leave it alone.
-    gtk_window_set_keep_above       (GTK_WINDOW(window), true);
-    gtk_window_set_skip_taskbar_hint(GTK_WINDOW(window), true);
-    gtk_window_set_skip_pager_hint  (GTK_WINDOW(window), true);
-    gtk_window_set_focus_on_map     (GTK_WINDOW(window), false);
-    gtk_window_set_accept_focus     (GTK_WINDOW(window), true);
-    gtk_window_set_decorated        (GTK_WINDOW(window), false);
-    gtk_window_set_resizable        (GTK_WINDOW(window), false);
-
-    // "Can't touch this!" - to user actions
-    //
-    // Set the input shape (area where clicks are recognised) to a zero-width,
-    // zero-height region a.k.a. nothing.  This makes clicks pass through the
-    // window onto whatever's below.
-    realize_input_shape();
-
-    // Now it's safe to show the window again.  It should be click-through, and
-    // the WM should ignore it.
-    gdk_window_show(GDK_WINDOW(gdk_window));
-
-    // Move window to match monitor layout.  This should already have been done
-    // by `screen_changed` above, but we repeat it here after
-    // `gdk_window_show`, in case the running window manager applies its own
-    // overriding rules for initial window positioning when a window becomes
-    // visible.  This could cause a few frames of the wrong window position
-    // being shown on affected window managers, but should do nothing on window
-    // managers that behave properly.
-    size_to_screen(GTK_WINDOW(window));
-
-    //
-    // Set up the JavaScript API
-    //
-
-    // Set up listeners for calls from JavaScript.
-    WebKitUserContentManager *manager =
-        webkit_web_view_get_user_content_manager(WEBKIT_WEB_VIEW(web_view));
-    g_signal_connect(manager, "script-message-received::getMonitorLayout",
-            G_CALLBACK(on_js_call_get_monitor_layout), web_view);
-    g_signal_connect(manager, "script-message-received::setClickableAreas",
-            G_CALLBACK(on_js_call_set_clickable_areas), web_view);
-    g_signal_connect(manager, "script-message-received::showInspector",
-            G_CALLBACK(on_js_call_show_inspector), web_view);
-
-    // Set up message handlers on the JavaScript side.  These appear under
-    // window.webkit.messageHandlers.
-    webkit_user_content_manager_register_script_message_handler(manager,
-            "getMonitorLayout");
-    webkit_user_content_manager_register_script_message_handler(manager,
-            "setClickableAreas");
-    webkit_user_content_manager_register_script_message_handler(manager,
-            "showInspector");
-
-    // Set up our Hudkit object to be loaded in the browser JS before anything
-    // else does.  Its functions are wrappers around the appropriate WebKit
-    // message handlers we just set up above.
-    //
-    // The `_pendingCallbacks` property is un-enumerable, so it doesn't show up
-    // in console.log or such.  It would be nice to hide it properly by closing
-    // over it (like `nextCallbackId` is), but it needs to be accessible
-    // externally by `call_js_callback`.
-    webkit_user_content_manager_add_script(
-            manager,
-            webkit_user_script_new(
-"\nlet nextCallbackId = 0"
-"\nwindow.Hudkit = {"
-"\n  on: function (eventName, callback) {"
-"\n    if (window.Hudkit._listeners.has(eventName)) {"
-"\n      window.Hudkit._listeners.get(eventName).push(callback)"
-"\n    } else {"
-"\n      window.Hudkit._listeners.set(eventName, [callback])"
-"\n    }"
-"\n  },"
-"\n  off: function (eventName, callback) {"
-"\n    const listenersForThisEvent = window.Hudkit._listeners.get(eventName)"
-"\n    if (listenersForThisEvent) {"
-"\n      listenersForThisEvent.splice(listenersForThisEvent.indexOf(callback), 1)"
-"\n    }"
-"\n  },"
-"\n  getMonitorLayout: async function () {"
-"\n    return new Promise((resolve, reject) => {"
-"\n      const id = nextCallbackId++"
-"\n      window.Hudkit._pendingCallbacks[id] = { resolve, reject }"
-"\n      window.webkit.messageHandlers.getMonitorLayout.postMessage(id)"
-"\n    })"
-"\n  },"
-"\n  setClickableAreas: async function (rectangles) {"
-"\n    return new Promise((resolve, reject) => {"
-"\n      const id = nextCallbackId++"
-"\n      window.Hudkit._pendingCallbacks[id] = { resolve, reject }"
-"\n      rectangles = rectangles.map(r => {"
-"\n         return { x: r.x, y: r.y, width: r.width, height: r.height }"
-"\n      })"
-"\n      window.webkit.messageHandlers.setClickableAreas.postMessage({id, rectangles})"
-"\n    })"
-"\n  },"
-"\n  showInspector: async function (shouldAttachToWindow) {"
-"\n    shouldAttachToWindow = shouldAttachToWindow ? true : false"
-"\n    return new Promise((resolve, reject) => {"
-"\n      const id = nextCallbackId++"
-"\n      window.Hudkit._pendingCallbacks[id] = { resolve, reject }"
-"\n      window.webkit.messageHandlers.showInspector.postMessage({id, shouldAttachToWindow})"
-"\n    })"
-"\n  },"
-"\n}"
-"\nObject.defineProperty(window.Hudkit, '_pendingCallbacks', {"
-"\n  value: [],"
-"\n  enumerable: false,"
-"\n  configurable: false,"
-"\n  writable: true,"
-"\n})"
-"\nObject.defineProperty(window.Hudkit, '_listeners', {"
-"\n  value: new Map(),"
-"\n  enumerable: false,"
-"\n  configurable: false,"
-"\n  writable: true,"
-"\n})",
-                WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
-                WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
-                NULL, NULL));
-
     // Start main UI loop
+    startup_trace("main loop starting");
     gtk_main();
     return 0;
 }
 
-static void size_to_screen(GtkWindow *window) {
-    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
-
-    // Get total screen size.  This involves finding all physical monitors
-    // connected, and examining their positions and sizes.  This is as complex
-    // as it is because monitors can be configured to have relative
-    // positioning, causing overlapping areas and a non-rectangular total
-    // desktop area.
-    //
-    // We want our window to cover the minimum axis-aligned bounding box of
-    // that total desktop area.  This means it's too large (even large bits of
-    // it may be outside the accessible desktop) but it's easier to manage than
-    // multiple windows.
-
-    GdkDisplay *display = gdk_display_get_default();
-    GdkRectangle *rectangles = NULL;
-    int nRectangles = get_monitor_rects(display, &rectangles);
-
-    // I can't think of a reason why someone's monitor setup might have a
-    // monitor positioned origin at negative x, y coordinates, but just in case
-    // someone does, we'll cover for it.
+static void size_to_screen(struct overlay *overlay) {
+    GtkWindow *window = GTK_WINDOW(overlay->window);
     int x = 0, y = 0, width = 0, height = 0;
-    for (int i = 0; i < nRectangles; ++i) {
-        GdkRectangle rect = rectangles[i];
-        int left = rect.x;
-        int top = rect.y;
-        int right = rect.x + rect.width;
-        int bottom = rect.y + rect.height;
-        if (left < x) x = left;
-        if (top < y) y = top;
-        if (width < right) width = right;
-        if (height < bottom) height = bottom;
-    }
-    free(rectangles);
-
-    gtk_window_move(GTK_WINDOW(window), x, y);
+
+    if (overlay->monitor) {
+        // This overlay only covers one monitor, so that's easy.
+        GdkRectangle rect;
+        gdk_monitor_get_geometry(overlay->monitor, &rect);
+        x = rect.x;
+        y = rect.y;
+        width = rect.width;
+        height = rect.height;
+    } else {
+        // Get total screen size.  This involves finding all physical monitors
+        // connected, and examining their positions and sizes.  This is as
+        // complex as it is because monitors can be configured to have
+        // relative positioning, causing overlapping areas and a
+        // non-rectangular total desktop area.
+        //
+        // We want our window to cover the minimum axis-aligned bounding box of
+        // that total desktop area.  This means it's too large (even large bits
+        // of it may be outside the accessible desktop) but it's easier to
+        // manage than multiple windows.  (If that's a problem, --per-monitor
+        // gives each monitor its own overlay instead.)
+
+        GArray *monitors = monitor_layout.monitors;
+
+        // I can't think of a reason why someone's monitor setup might have a
+        // monitor positioned origin at negative x, y coordinates, but just in
+        // case someone does, we'll cover for it.
+        for (int i = 0; i < monitors->len; ++i) {
+            GdkRectangle rect =
+                g_array_index(monitors, struct monitor_info, i).geometry;
+            int left = rect.x;
+            int top = rect.y;
+            int right = rect.x + rect.width;
+            int bottom = rect.y + rect.height;
+            if (left < x) x = left;
+            if (top < y) y = top;
+            if (width < right) width = right;
+            if (height < bottom) height = bottom;
+        }
+    }
+
+    overlay->geometry.x = x;
+    overlay->geometry.y = y;
+    overlay->geometry.width = width;
+    overlay->geometry.height = height;
+
+    // An offscreen window is as big as what's in it asks to be.
+    if (headless_monitors)
+        gtk_widget_set_size_request(overlay->stack, width, height);
+    gtk_window_move(window, x, y);
     gtk_window_set_default_size(window, width, height);
     gtk_window_resize(window, width, height);
     gtk_window_set_resizable(window, false);
 
-    // Remove the user-defined input shape, since it's certainly in completely
-    // the wrong position now.
-    g_array_set_size(user_defined_input_rects, 0);
-    realize_input_shape();
-}
-
-
-void call_js_listeners(WebKitWebView *web_view, char *eventName, char *stringifiedData) {
-    // Calls the user's registered JS listener functions for the given event
-    // name, simply string-placing the stringified data between its call
-    // parentheses.
-    //
-    // Ensure `stringifiedData` is sanitised!  It will basically be `eval`ed in
-    // the web page's context.
-
-    GString *response_buffer = g_string_new(NULL);
-    g_string_append_printf(response_buffer,
-            "\n(() => { // IIFE"
-            "\n  const listenersForEvent = window.Hudkit._listeners.get('%s')"
-            "\n  if (listenersForEvent) {"
-            "\n    listenersForEvent.forEach(f => f(%s))"
-            "\n  }"
-            "\n})()",
-            eventName,
-            stringifiedData);
-
-    char *finished_buffer = g_string_free(response_buffer, FALSE);
-    printf("%s\n", finished_buffer);
-    webkit_web_view_evaluate_javascript(
-        web_view,
-        finished_buffer,
-        -1, // `length` (-1 indicates a NULL-terminated string)
-        NULL, // `world_name` (NULL indicates default)
-        NULL, // `source_uri` (NULL indicates there's no associated file)
-        NULL, // `cancellable` (NULL indicates we don't care)
-        on_js_call_finished, // callback
-        NULL // `user_data`
-    );
-    g_free(finished_buffer);
+    // Remove the user-defined input shapes, since they're certainly in
+    // completely the wrong position now.  The same goes for declared painted
+    // areas; until the page declares new ones, they're detected.
+    for (int i = 0; i < overlay->layers->len; ++i) {
+        struct layer *layer = g_ptr_array_index(overlay->layers, i);
+        g_array_set_size(layer->user_defined_input_rects, 0);
+        layer->declares_painted_areas = FALSE;
+        g_array_set_size(layer->painted_rects, 0);
+    }
+    queue_input_shape(overlay);
 }
 
 
 gulong monitors_changed_handler_id = 0;
 
+// How long monitors have to stay unchanged before we act on a change.  Tools
+// like xrandr tend to cause several monitors-changed signals in a quick burst
+// while they reconfigure things, and only the final state matters.
+#define MONITORS_CHANGED_DEBOUNCE_MS 100
+guint monitors_changed_debounce_id = 0;
+
+static gboolean on_monitors_settled(gpointer user_data) {
+    GdkScreen *screen = user_data;
+    monitors_changed_debounce_id = 0;
+
+    // If the burst of signals ended up changing nothing, nothing needs doing.
+    JSCValue *diff = NULL;
+    if (!update_monitor_layout(gdk_screen_get_display(screen), &diff))
+        return G_SOURCE_REMOVE;
+
+    // Existing overlays get resized and told about it.  Overlays created here
+    // for newly connected monitors (with --per-monitor) start out with the
+    // right size and haven't loaded their page yet, so they're skipped.
+    int n_created = 0;
+    if (per_monitor_windows)
+        n_created = sync_per_monitor_overlays(gdk_screen_get_display(screen));
+    int n_existing = overlays->len - n_created;
+
+    for (int i = 0; i < n_existing; ++i) {
+        struct overlay *overlay = g_ptr_array_index(overlays, i);
+        size_to_screen(overlay);
+        emit_event_to_layers(overlay, "monitors-changed", NULL,
+                g_object_ref(diff), EVENT_QUEUE);
+    }
+    g_object_unref(diff);
+    // Fullscreen windows might cover the monitors differently now.
+    schedule_visibility_update();
+    return G_SOURCE_REMOVE;
+}
+
 static void on_monitors_changed(GdkScreen *screen, gpointer user_data) {
-    WebKitWebView *web_view = (WebKitWebView *)user_data;
-    size_to_screen(GTK_WINDOW(window));
-    call_js_listeners(web_view, "monitors-changed", "");
+    // Restart the wait every time, so we act once the burst is over.
+    if (monitors_changed_debounce_id)
+        g_source_remove(monitors_changed_debounce_id);
+    monitors_changed_debounce_id = g_timeout_add(MONITORS_CHANGED_DEBOUNCE_MS,
+            on_monitors_settled, screen);
 }
 
 // This callback runs when the window is first set to appear on some screen, or
@@ -986,10 +5835,11 @@ static void screen_changed(GtkWidget *widget, GdkScreen *old_screen,
         gpointer user_data) {
     GdkScreen *screen = gtk_widget_get_screen(widget);
 
-    WebKitWebView *web_view = (WebKitWebView *)user_data;
+    struct overlay *overlay = user_data;
 
-    // Die unless the screen supports compositing (alpha blending)
-    if (!gdk_screen_is_composited(screen)) {
+    // Die unless the screen supports compositing (alpha blending).  Headless,
+    // nothing is composited onto the screen, so it doesn't matter.
+    if (!headless_monitors && !gdk_screen_is_composited(screen)) {
         fprintf(stderr, "Your screen does not support transparency.\n");
         fprintf(stderr, "Maybe your compositor isn't running?\n");
         gtk_widget_destroy(widget);
@@ -999,14 +5849,22 @@ static void screen_changed(GtkWidget *widget, GdkScreen *old_screen,
     // Ensure the widget can take RGBA
     gtk_widget_set_visual(widget, gdk_screen_get_rgba_visual(screen));
 
+    // The virtual monitors never change.
+    if (headless_monitors) {
+        size_to_screen(overlay);
+        return;
+    }
+
     // Switch monitors-changed subscription from the old screen (if applicable)
-    // to the new one
+    // to the new one.  There's only one subscription no matter how many
+    // overlays there are, so only the first overlay to appear creates it.
     if (old_screen)
         g_signal_handler_disconnect(old_screen, monitors_changed_handler_id);
-    monitors_changed_handler_id = g_signal_connect(screen, "monitors-changed",
-            G_CALLBACK(on_monitors_changed), web_view);
+    if (old_screen || !monitors_changed_handler_id)
+        monitors_changed_handler_id = g_signal_connect(screen,
+                "monitors-changed", G_CALLBACK(on_monitors_changed), NULL);
 
-    size_to_screen(GTK_WINDOW(widget));
+    size_to_screen(overlay);
 }
 
 // This callback runs when JavaScript on the page calls window.close()
@@ -1018,8 +5876,10 @@ static void on_close_web_view(WebKitWebView *web_view, gpointer user_data) {
 // This callback runs when the screen's composited status changes.  That is,
 // the screen's ability to render transparency.
 static void composited_changed(GdkScreen *s, gpointer user_data) {
-    WebKitWebView *web_view = (WebKitWebView *)user_data;
-    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(web_view));
-    call_js_listeners(web_view, "composited-changed",
-            gdk_screen_is_composited(screen) ? "true" : "false");
+    struct overlay *overlay = user_data;
+    GdkScreen *screen = gtk_widget_get_screen(overlay->window);
+    emit_event_to_layers(overlay, "composited-changed", NULL,
+            jsc_value_new_boolean(native_js_context,
+                gdk_screen_is_composited(screen)),
+            EVENT_LATEST);
 }
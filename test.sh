@@ -10,6 +10,8 @@
 # - hsetroot
 # - xwd (apt: x11-apps, pacman: xorg-xwd)
 # - convert (from imagemagick)
+# - timeout (from coreutils)
+# - xdotool
 #
 export DISPLAY=:99
 echo "Starting Xvfb"
@@ -28,6 +30,8 @@ sleep 0.5
 echo '- - -'
 
 tmpfile_output="/tmp/hudkit_test_output.txt"
+tmpfile_headless_output="/tmp/hudkit_test_headless_output.txt"
+tmpfile_checksums="/tmp/hudkit_test_checksums.txt"
 tmpfile_html="/tmp/hudkit_test_input.html"
 echo '''
 <html>
@@ -43,6 +47,9 @@ console.log("what")
   console.log(JSON.stringify({ userAgent: navigator.userAgent }))
   Hudkit.on("composited-changed", hasTransparency =>
     console.log(`hasTransparency ${hasTransparency}`))
+  Hudkit.on("input", event => {
+    if (event.type === "key") console.log(`input ${JSON.stringify(event)}`)
+  })
 })()
 </script>
 </html>
@@ -52,7 +59,7 @@ cat "$tmpfile_html"
 echo '- - -'
 
 echo "Starting Hudkit"
-./hudkit --webkit-settings user-agent=test_ua "file://$tmpfile_html" > "$tmpfile_output" 2>&1 & hudkit_pid=$!
+./hudkit --webkit-settings user-agent=test_ua --input-events "file://$tmpfile_html" > "$tmpfile_output" 2>&1 & hudkit_pid=$!
 # We have to redirect stderr to stdout (2>&1), because webkit's
 # 'enable-write-console-messages-to-stdout' setting is a lie; it actually logs
 # to stderr.
@@ -64,6 +71,11 @@ out=$(xwd -root -silent | convert xwd:- -depth 8 -crop "1x1+0+0" txt:- | grep -o
 echo "Pixel value at (0,0): $out"
 echo '- - -'
 
+echo "Typing a synthetic key press"
+xdotool key a
+sleep 1 # Give the 'input' listener time to fire
+echo '- - -'
+
 # Deliberaretely killing the compositor first, to fire the composited-changed
 # listener in JS, so we can test for that.
 echo "Killing compton"
@@ -73,6 +85,15 @@ sleep 2 # Give the 'composited-changed' listener time to fire
 echo "Killing hudkit"
 kill "$hudkit_pid"
 wait "$hudkit_pid"
+echo '- - -'
+
+# The compositor is gone by now, which headless mode shouldn't care about.
+echo "Running Hudkit headless"
+# It doesn't exit by itself, so it's stopped after a few seconds.
+timeout 5 ./hudkit --headless 640x480,800x600 \
+    --headless-checksums "$tmpfile_checksums" \
+    "file://$tmpfile_html" > "$tmpfile_headless_output" 2>&1
+echo '- - -'
 echo "Killing Xvfb"
 kill "$xvfb_pid"
 wait "$xvfb_pid"
@@ -92,11 +113,10 @@ fi
 echo '- - -'
 
 echo "Comparing output log"
-expected_to_contain=$(cat <<END
-CONSOLE LOG [{"name":"screen","x":0,"y":0,"width":1280,"height":1024}]
-END
-)
-if grep --quiet --fixed-strings "$expected_to_contain" "$tmpfile_output"; then
+# Xvfb makes up a refresh rate and physical size, so those are only checked
+# for being numbers.
+expected_to_contain='CONSOLE LOG \[{"name":"screen","x":0,"y":0,"width":1280,"height":1024,"scale":1,"refreshRate":[0-9.]+,"widthMm":[0-9]+,"heightMm":[0-9]+}\]'
+if grep --quiet --extended-regexp "$expected_to_contain" "$tmpfile_output"; then
     echo "Saw Hudkit.getMonitorLayout() response in log!  OK."
 else
     echo "Did not see Hudkit.getMonitorLayout() response in log!"
@@ -124,12 +144,40 @@ else
     echo "Did not see output from 'composited-changed' listener in log!"
     exit_code=1
 fi
+
+expected_to_contain='CONSOLE LOG input {"type":"key","pressed":true,"keycode":[0-9]+,"key":"a"}'
+if grep --quiet --extended-regexp "$expected_to_contain" "$tmpfile_output"; then
+    echo "Saw output from 'input' listener in log!  OK."
+else
+    echo "Did not see output from 'input' listener in log!"
+    exit_code=1
+fi
+
+expected_to_contain=$(cat <<END
+CONSOLE LOG [{"name":"headless-0","x":0,"y":0,"width":640,"height":480,"scale":1,"refreshRate":60,"widthMm":0,"heightMm":0},{"name":"headless-1","x":640,"y":0,"width":800,"height":600,"scale":1,"refreshRate":60,"widthMm":0,"heightMm":0}]
+END
+)
+if grep --quiet --fixed-strings "$expected_to_contain" "$tmpfile_headless_output"; then
+    echo "Saw --headless monitor layout in log!  OK."
+else
+    echo "Did not see --headless monitor layout in log!"
+    exit_code=1
+fi
+
+if grep --quiet '^{"frame":1,.*"width":1440,"height":600,"checksum":"[0-9a-f]\{40\}"}$' "$tmpfile_checksums"; then
+    echo "Saw a --headless-checksums line for the first frame!  OK."
+else
+    echo "Did not see a --headless-checksums line for the first frame!"
+    exit_code=1
+fi
 echo '- - -'
 
 if (( "$exit_code" > 0 )); then
     echo "Some tests failed."
     echo "Hudkit output:"
     cat "$tmpfile_output"
+    echo "Headless Hudkit output:"
+    cat "$tmpfile_headless_output"
 else
     echo "All tests passed.  :)"
 fi
@@ -138,5 +186,7 @@ echo '- - -'
 # Remove temporary files
 rm "$tmpfile_html"
 rm "$tmpfile_output"
+rm "$tmpfile_headless_output"
+rm -f "$tmpfile_checksums"
 
 exit "$exit_code"